@@ -151,7 +151,8 @@ PRODUCT_PACKAGES += \
     bootctrl.sdm845.recovery
 
 PRODUCT_PACKAGES_DEBUG += \
-    bootctl
+    bootctl \
+    gpt-diff.sony_tama
 
 # Camera
 PRODUCT_PACKAGES += \
@@ -0,0 +1,74 @@
+/*
+ * SPDX-FileCopyrightText: 2024 The LineageOS Project
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//Throughput of sparse_crc32(), with the kernel picked for the CPU and with
+//the portable slice-by-8 one, against the bytewise table loop it used
+//before, over the sizes of a GPT entry array (16 KiB), of a large one and
+//of a sparse image chunk
+
+#include <stdint.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "../sparse_crc32.h"
+
+namespace {
+
+struct Crc32Table {
+    uint32_t t[256];
+};
+
+constexpr Crc32Table MakeCrc32Table() {
+    Crc32Table tab = {};
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int i = 0; i < 8; i++) crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+        tab.t[b] = crc;
+    }
+    return tab;
+}
+
+constexpr Crc32Table kCrc32Table = MakeCrc32Table();
+
+uint32_t BytewiseCrc32(uint32_t crc, const void* buf, size_t size) {
+    const uint8_t* p = static_cast<const uint8_t*>(buf);
+
+    crc ^= ~0U;
+    while (size--) crc = kCrc32Table.t[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc ^ ~0U;
+}
+
+std::vector<uint8_t> Buffer(size_t size) {
+    std::vector<uint8_t> buf(size);
+    for (size_t i = 0; i < size; i++) buf[i] = i * 2654435761u >> 24;
+    return buf;
+}
+
+template <uint32_t (*Crc32)(uint32_t, const void*, size_t)>
+void BM_Crc32(benchmark::State& state) {
+    std::vector<uint8_t> buf = Buffer(state.range(0));
+
+    if (Crc32(0, buf.data(), buf.size()) != BytewiseCrc32(0, buf.data(), buf.size()))
+        state.SkipWithError("CRC mismatch");
+    for (auto _ : state) benchmark::DoNotOptimize(Crc32(0, buf.data(), buf.size()));
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_Crc32<sparse_crc32>)->Arg(16 << 10)->Arg(64 << 10)->Arg(1 << 20);
+BENCHMARK(BM_Crc32<BytewiseCrc32>)->Arg(16 << 10)->Arg(64 << 10)->Arg(1 << 20);
+
+//The fallback for CPUs without CRC instructions, which the runtime dispatch
+//never picks on the machines this usually runs on
+void BM_Crc32Portable(benchmark::State& state) {
+    sparse_crc32_force_portable(1);
+    BM_Crc32<sparse_crc32>(state);
+    sparse_crc32_force_portable(0);
+}
+BENCHMARK(BM_Crc32Portable)->Arg(16 << 10)->Arg(64 << 10)->Arg(1 << 20);
+
+}  // namespace
+
+BENCHMARK_MAIN();
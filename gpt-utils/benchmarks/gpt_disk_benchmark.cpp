@@ -0,0 +1,231 @@
+/*
+ * SPDX-FileCopyrightText: 2024 The LineageOS Project
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//Load, lookup, CRC update and commit of the gpt_disk API on synthetic
+//eMMC and UFS layouts, through the image backend
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <benchmark/benchmark.h>
+
+#include "../tests/gpt_image.h"
+
+using gpt_test::ImageDir;
+
+namespace {
+
+enum LayoutType { kEmmc, kUfs };
+
+//Both slots of every A/B partition plus their backups where the device
+//has them. eMMC keeps everything on one 512 byte sector disk, UFS spreads
+//it over four 4096 byte sector LUNs. Tables are shared through a snapshot
+//if asked for.
+struct Layout {
+    ImageDir dir;
+    gpt_utils_backend backend;
+    //Disk holding boot_a, and its partitions
+    std::string disk;
+    std::vector<std::string> names;
+
+    explicit Layout(LayoutType type, bool direct_io = false, bool snapshot = false) {
+        static const char* ab[] = {AB_PTN_LIST};
+        std::vector<std::vector<std::string>> luns(type == kEmmc ? 1 : 4);
+        for (size_t i = 0; i < sizeof(ab) / sizeof(ab[0]); i++) {
+            std::vector<std::string>& lun = luns[i % luns.size()];
+            lun.push_back(std::string(ab[i]) + AB_SLOT_A_SUFFIX);
+            lun.push_back(std::string(ab[i]) + AB_SLOT_B_SUFFIX);
+        }
+        uint32_t bs = type == kEmmc ? 512 : 4096;
+        for (size_t i = 0; i < luns.size(); i++) {
+            std::string lun = type == kEmmc ? "mmcblk0" : std::string("sd") + char('a' + i);
+            dir.AddDisk(lun, bs, luns[i]);
+            if (std::find(luns[i].begin(), luns[i].end(), "boot_a") != luns[i].end()) {
+                disk = dir.Disk(lun);
+                names = luns[i];
+            }
+        }
+        backend = dir.Backend(type == kUfs, bs, type == kEmmc ? "mmcblk0" : "",
+                              snapshot ? "snapshot" : nullptr);
+        backend.direct_io = direct_io;
+        gpt_utils_set_backend(&backend);
+    }
+    ~Layout() { gpt_utils_set_backend(nullptr); }
+};
+
+//Pages of path in the page cache
+double CachedPages(const std::string& path) {
+    long page = sysconf(_SC_PAGESIZE);
+    double cached = 0;
+    struct stat st;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st)) return -1;
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    std::vector<unsigned char> resident((st.st_size + page - 1) / page);
+    if (map != MAP_FAILED && !mincore(map, st.st_size, resident.data()))
+        for (unsigned char r : resident) cached += r & 1;
+    if (map != MAP_FAILED) munmap(map, st.st_size);
+    close(fd);
+    return cached;
+}
+
+//Drops the clean pages of path from the page cache
+void DropCache(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+//Loads boot_a's disk, with its pages dropped from the page cache before
+//each load if range(1) is set, as happens to a process started long after
+//the last one that read the disk
+void LoadBoot(benchmark::State& state, bool snapshot) {
+    Layout layout((LayoutType)state.range(0), false, snapshot);
+    struct gpt_disk* disk = gpt_disk_alloc();
+    for (auto _ : state) {
+        if (state.range(1)) {
+            state.PauseTiming();
+            DropCache(layout.disk);
+            state.ResumeTiming();
+        }
+        if (gpt_disk_get_disk_info("boot_a", disk)) {
+            state.SkipWithError("load failed");
+            break;
+        }
+    }
+    gpt_disk_free(disk);
+}
+
+void BM_Load(benchmark::State& state) {
+    LoadBoot(state, false);
+}
+BENCHMARK(BM_Load)->ArgNames({"ufs", "cold"})->ArgsProduct({{kEmmc, kUfs}, {0, 1}});
+
+//Loads after the first one take the tables from the snapshot instead of
+//reading the disk. Cold loads show the reads saved, which need a file
+//system that drops pages for TMPDIR; tmpfs keeps the images cached.
+void BM_LoadSnapshot(benchmark::State& state) {
+    LoadBoot(state, true);
+}
+BENCHMARK(BM_LoadSnapshot)->ArgNames({"ufs", "cold"})->ArgsProduct({{kEmmc, kUfs}, {0, 1}});
+
+void BM_Lookup(benchmark::State& state) {
+    Layout layout((LayoutType)state.range(0));
+    struct gpt_disk* disk = gpt_disk_alloc();
+    if (gpt_disk_get_disk_info("boot_a", disk)) state.SkipWithError("load failed");
+    for (auto _ : state) {
+        for (const std::string& name : layout.names) {
+            benchmark::DoNotOptimize(gpt_disk_find_pentry(disk, name.c_str(), PRIMARY_GPT));
+            benchmark::DoNotOptimize(gpt_disk_find_pentry(disk, name.c_str(), SECONDARY_GPT));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * layout.names.size() * 2);
+    gpt_disk_free(disk);
+}
+BENCHMARK(BM_Lookup)->ArgName("ufs")->Arg(kEmmc)->Arg(kUfs);
+
+//Lookups of the last entry and of a missing name in an eMMC table of
+//range(0) entries, which should not depend on the table size
+void BM_LookupTableSize(benchmark::State& state) {
+    ImageDir dir;
+    std::vector<std::string> partitions;
+    for (int64_t i = 0; i < state.range(0); i++) partitions.push_back("p" + std::to_string(i));
+    dir.AddDisk("mmcblk0", 512, partitions, partitions.size(), 1);
+    gpt_utils_backend backend = dir.Backend(false, 512, "mmcblk0");
+    gpt_utils_set_backend(&backend);
+
+    struct gpt_disk* disk = gpt_disk_alloc();
+    if (gpt_disk_get_disk_info("p0", disk)) state.SkipWithError("load failed");
+    const char* last = partitions.back().c_str();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(gpt_disk_find_pentry(disk, last, PRIMARY_GPT));
+        benchmark::DoNotOptimize(gpt_disk_find_pentry(disk, "missing", PRIMARY_GPT));
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+    gpt_disk_free(disk);
+    gpt_utils_set_backend(nullptr);
+}
+BENCHMARK(BM_LookupTableSize)->RangeMultiplier(4)->Range(128, 16384);
+
+//Lookups of names sharing prefixes, as the XBL ones do, present or not,
+//in an eMMC table of range(0) entries. The other entries share the same
+//prefixes, and the XBL ones come last.
+void BM_LookupNearMiss(benchmark::State& state) {
+    static const char* names[] = {"xbl", "xbl_config", "xblbak", "xbl_configbak",
+                                  "xb",  "xbl_",       "xblb",   "xbl_configba"};
+    ImageDir dir;
+    std::vector<std::string> partitions;
+    for (int64_t i = 0; partitions.size() + 4 < (size_t)state.range(0); i++)
+        partitions.push_back((i % 2 ? "xbl_config" : "xbl") + std::to_string(i));
+    for (const char* name : {"xbl_configbak", "xblbak", "xbl_config", "xbl"})
+        partitions.push_back(name);
+    dir.AddDisk("mmcblk0", 512, partitions, partitions.size(), 1);
+    gpt_utils_backend backend = dir.Backend(false, 512, "mmcblk0");
+    gpt_utils_set_backend(&backend);
+
+    struct gpt_disk* disk = gpt_disk_alloc();
+    if (gpt_disk_get_disk_info("xbl", disk)) state.SkipWithError("load failed");
+    for (auto _ : state)
+        for (const char* name : names)
+            benchmark::DoNotOptimize(gpt_disk_find_pentry(disk, name, PRIMARY_GPT));
+    state.SetItemsProcessed(state.iterations() * (sizeof(names) / sizeof(names[0])));
+    gpt_disk_free(disk);
+    gpt_utils_set_backend(nullptr);
+}
+BENCHMARK(BM_LookupNearMiss)->RangeMultiplier(4)->Range(128, 16384);
+
+//Flips the A/B attribute byte of boot_a in both tables and updates the
+//CRCs, then writes the change if commit is set. Commits report the pages
+//of the disk they leave in the page cache.
+void UpdateBoot(benchmark::State& state, bool commit, bool direct_io = false) {
+    Layout layout((LayoutType)state.range(0), direct_io);
+    struct gpt_disk* disk = gpt_disk_alloc();
+    if (gpt_disk_get_disk_info("boot_a", disk)) state.SkipWithError("load failed");
+    DropCache(layout.disk);
+    uint8_t attr = 0;
+    for (auto _ : state) {
+        attr ^= AB_PARTITION_ATTR_BOOT_SUCCESSFUL;
+        for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+            const uint8_t* pentry = gpt_disk_find_pentry(disk, "boot_a", instance);
+            if (!pentry ||
+                gpt_disk_update_pentry(disk, instance, pentry, AB_FLAG_OFFSET, &attr, 1)) {
+                state.SkipWithError("update failed");
+                break;
+            }
+        }
+        if (gpt_disk_update_crc(disk) || (commit && gpt_disk_commit(disk))) {
+            state.SkipWithError(commit ? "commit failed" : "crc update failed");
+            break;
+        }
+    }
+    if (commit) state.counters["cached_pages"] = CachedPages(layout.disk);
+    gpt_disk_free(disk);
+}
+
+void BM_UpdateCrc(benchmark::State& state) {
+    UpdateBoot(state, false);
+}
+BENCHMARK(BM_UpdateCrc)->ArgName("ufs")->Arg(kEmmc)->Arg(kUfs);
+
+void BM_Commit(benchmark::State& state) {
+    UpdateBoot(state, true);
+}
+BENCHMARK(BM_Commit)->ArgName("ufs")->Arg(kEmmc)->Arg(kUfs);
+
+//Same with the writes bypassing the page cache. Needs a file system with
+//O_DIRECT support for TMPDIR, tmpfs falls back to cached writes.
+void BM_CommitDirectIo(benchmark::State& state) {
+    UpdateBoot(state, true, true);
+}
+BENCHMARK(BM_CommitDirectIo)->ArgName("ufs")->Arg(kEmmc)->Arg(kUfs);
+
+}  // namespace
@@ -0,0 +1,95 @@
+/*
+ * SPDX-FileCopyrightText: 2024 The LineageOS Project
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//Reports how the primary and backup partition tables of the disks holding
+//the given partitions differ, one line per differing entry:
+//  <disk> <index> <fields> primary <first>-<last> <attr> <name> backup ...
+//Exits with 0 if the tables match, 1 if they differ and 2 on error.
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "gpt-utils.h"
+
+static const struct {
+    uint32_t flag;
+    const char *name;
+} diff_fields[] = {
+    { GPT_PENTRY_DIFF_TYPE_GUID, "type" },
+    { GPT_PENTRY_DIFF_UNIQUE_GUID, "guid" },
+    { GPT_PENTRY_DIFF_LBA, "lba" },
+    { GPT_PENTRY_DIFF_ATTR, "attr" },
+    { GPT_PENTRY_DIFF_NAME, "name" },
+    { GPT_PENTRY_DIFF_OTHER, "other" },
+    { GPT_PENTRY_DIFF_MISSING, "missing" },
+};
+
+static void print_entry(const struct gpt_pentry_view *view, uint32_t i)
+{
+    if (i >= view->num) {
+        printf(" -");
+        return;
+    }
+    printf(" %" PRIu64 "-%" PRIu64 " 0x%016" PRIx64 " %s",
+           view->first_lba[i], view->last_lba[i], view->attr[i],
+           view->name[i][0] ? view->name[i] : "-");
+}
+
+static int diff_disk(const char *partname)
+{
+    struct gpt_disk *disk = gpt_disk_alloc();
+    const struct gpt_pentry_view *view, *view_bak;
+    std::vector<struct gpt_pentry_diff> diffs;
+    int count, r = 2;
+
+    if (!disk || gpt_disk_get_disk_info(partname, disk)) {
+        fprintf(stderr, "%s: Failed to read partition tables\n", partname);
+        goto out;
+    }
+    view = gpt_disk_get_view(disk, PRIMARY_GPT);
+    view_bak = gpt_disk_get_view(disk, SECONDARY_GPT);
+    count = gpt_disk_diff_pentries(disk, NULL, 0);
+    if (count > 0) {
+        diffs.resize(count);
+        count = gpt_disk_diff_pentries(disk, diffs.data(), count);
+    }
+    if (count < 0 || !view || !view_bak)
+        goto out;
+    for (int i = 0; i < count; i++) {
+        uint32_t n = 0;
+        printf("%s %u ", disk->devpath, diffs[i].index);
+        for (size_t f = 0; f < sizeof(diff_fields) / sizeof(diff_fields[0]); f++)
+            if (diffs[i].fields & diff_fields[f].flag)
+                printf("%s%s", n++ ? "," : "", diff_fields[f].name);
+        printf(" primary");
+        print_entry(view, diffs[i].index);
+        printf(" backup");
+        print_entry(view_bak, diffs[i].index);
+        printf("\n");
+    }
+    r = count ? 1 : 0;
+out:
+    if (disk)
+        gpt_disk_free(disk);
+    return r;
+}
+
+int main(int argc, char **argv)
+{
+    int r = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <partition>...\n", argv[0]);
+        return 2;
+    }
+    for (int i = 1; i < argc; i++) {
+        int disk_r = diff_disk(argv[i]);
+        if (disk_r > r)
+            r = disk_r;
+    }
+    return r;
+}
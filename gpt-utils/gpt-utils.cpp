@@ -38,22 +38,44 @@
 #include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <scsi/ufs/ioctl.h>
 #include <scsi/ufs/ufs.h>
 #include <unistd.h>
 #include <linux/fs.h>
 #include <limits.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <linux/kernel.h>
+#include <atomic>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#include <algorithm>
 #include <map>
+#include <memory>
+#include <optional>
+#include <span>
 #include <vector>
 #include <string>
+#include <string_view>
 #define LOG_TAG "gpt-utils"
+#define ATRACE_TAG ATRACE_TAG_HAL
 #include <log/log.h>
 #include <cutils/properties.h>
+#include <cutils/trace.h>
+//strlcpy() outside of bionic, eg: for host builds
+#include <cutils/memory.h>
 #include "gpt-utils.h"
+#include "gpt.h"
 #include <endian.h>
-#include <zlib.h>
+#include "sparse_crc32.h"
 
 
 /******************************************************************************
@@ -63,10 +85,11 @@
 /* list the names of the backed-up partitions to be swapped */
 /* extension used for the backup partitions - tzbak, abootbak, etc. */
 #define BAK_PTN_NAME_EXT    "bak"
-#define XBL_PRIMARY         "/dev/block/bootdevice/by-name/xbl"
-#define XBL_BACKUP          "/dev/block/bootdevice/by-name/xblbak"
-#define XBL_AB_PRIMARY      "/dev/block/bootdevice/by-name/xbl_a"
-#define XBL_AB_SECONDARY    "/dev/block/bootdevice/by-name/xbl_b"
+/* by-name links of the xbl copies */
+#define XBL_PRIMARY         PTN_XBL
+#define XBL_BACKUP          PTN_XBL BAK_PTN_NAME_EXT
+#define XBL_AB_PRIMARY      PTN_XBL AB_SLOT_A_SUFFIX
+#define XBL_AB_SECONDARY    PTN_XBL AB_SLOT_B_SUFFIX
 /* GPT defines */
 #define MAX_LUNS                    26
 //Size of the buffer that needs to be passed to the UFS ioctl
@@ -78,10 +101,34 @@
 //contain partitions that interest us here.
 #define PATH_TRUNCATE_LOC (sizeof("/dev/block/sda") - 1)
 
-//From /dev/block/sda get just sda
-#define LUN_NAME_START_LOC (sizeof("/dev/block/") - 1)
+//Where the scsi generic node of a LUN is looked up
+#define SYSFS_BLOCK_DIR "/sys/block"
+#define SG_DEV_DIR "/dev"
+//Sector size assumed for disks that are regular image files
+#define DEFAULT_IMAGE_BLOCK_SIZE 512
 #define BOOT_LUN_A_ID 1
 #define BOOT_LUN_B_ID 2
+//Upper bound on threads preparing LUNs in parallel
+#define MAX_UPDATE_WORKERS 4
+//Entries compared at once by gpt_disk_diff_pentries()
+#define GPT_DIFF_CHUNK_ENTRIES      32
+//Standard GPT layout: the primary entry array starts right after the
+//primary header and holds 128 entries of 128 bytes. Used to read both in
+//one go; other layouts cost one extra read.
+#define GPT_STD_PENTRIES_LBA        2
+#define GPT_STD_PENTRY_ARR_SIZE     (128 * PTN_ENTRY_SIZE)
+//Latency histogram buckets of the stats: bucket i counts operations that
+//took less than 2^i us, the last one everything slower
+#define GPT_STAT_BUCKETS            16
+//Longest gpt_utils_wait_for_partitions() goes without looking for the
+//links while the by-name directory doesn't exist yet [ms]
+#define GPT_WAIT_ANCESTOR_RECHECK_MS 20
+//Partition table snapshot shared between processes, see gpt_snapshot_hdr
+#define GPT_SNAPSHOT_MAGIC          0x53545047 /* "GPTS" */
+#define GPT_SNAPSHOT_VERSION        1
+#define GPT_SNAPSHOT_PATH_SIZE      128
+#define GPT_SNAPSHOT_BOOT_ID_SIZE   40
+#define GPT_SNAPSHOT_MAX_SIZE       (4 * 1024 * 1024)
 /******************************************************************************
  * MACROS
  ******************************************************************************/
@@ -101,6 +148,8 @@
         ((uint64_t) *((uint8_t *)(ptr) + 6) << 48) | \
         ((uint64_t) *((uint8_t *)(ptr) + 7) << 56))
 
+#define DIV_ROUND_UP(x, y) (((x) + (y) - 1) / (y))
+
 #define PUT_4_BYTES(ptr, y)   *((uint8_t *)(ptr)) = (y) & 0xff; \
         *((uint8_t *)(ptr) + 1) = ((y) >> 8) & 0xff; \
         *((uint8_t *)(ptr) + 2) = ((y) >> 16) & 0xff; \
@@ -115,16 +164,241 @@ enum gpt_state {
     GPT_BAD_SIGNATURE,
     GPT_BAD_CRC
 };
+//Currently selected backend, see struct gpt_utils_backend
+struct gpt_backend_state {
+     char by_name_dir[PATH_MAX];
+     char emmc_disk[PATH_MAX];
+     int is_ufs;
+     uint32_t image_block_size;
+     int links_to_disks;
+     char snapshot_path[PATH_MAX];
+     int direct_io;
+     char sysfs_block_dir[PATH_MAX];
+     char sg_dev_dir[PATH_MAX];
+};
+static struct gpt_backend_state backend = {
+     BOOT_DEV_DIR, BLK_DEV_FILE, -1, DEFAULT_IMAGE_BLOCK_SIZE, 0,
+     "", 0, SYSFS_BLOCK_DIR, SG_DEV_DIR
+};
+//Snapshot of the partition tables and by-name links, shared by the
+//processes using the library during one boot through a file on tmpfs.
+//The file is never modified in place, only replaced. It holds this
+//header, num_paths disk paths of GPT_SNAPSHOT_PATH_SIZE bytes, num_links
+//gpt_snapshot_link and num_disks disk records. A disk record is a
+//gpt_snapshot_disk followed by the primary and backup headers and the
+//primary and backup entry arrays.
+struct gpt_snapshot_hdr {
+     uint32_t magic;
+     uint32_t version;
+     //Size of the file and its CRC, computed with crc set to 0
+     uint32_t size;
+     uint32_t crc;
+     //Snapshots only hold for the boot they were taken in
+     char boot_id[GPT_SNAPSHOT_BOOT_ID_SIZE];
+     //Directory the links were read from and its mtime, empty if there
+     //are no links
+     char by_name_dir[GPT_SNAPSHOT_PATH_SIZE];
+     int64_t dir_mtime_sec;
+     int64_t dir_mtime_nsec;
+     uint32_t num_paths;
+     uint32_t num_links;
+     uint32_t num_disks;
+     uint32_t reserved;
+};
+struct gpt_snapshot_link {
+     char name[MAX_GPT_NAME8_SIZE + 3];
+     //Disk holding the partition, index of its path
+     uint32_t path;
+};
+struct gpt_snapshot_disk {
+     //Index of the disk's path
+     uint32_t path;
+     uint32_t block_size;
+     uint64_t dev_size;
+     uint32_t arr_size;
+     uint32_t arr_bak_size;
+     //Size of the record including the tables, a multiple of 8
+     uint32_t size;
+     uint32_t reserved;
+};
+//One prepare_partitions() stage: the disk, the buffers all of its header
+//and entry array operations share, and its writes. The writes are split
+//into epochs by gpt_stage_barrier(): nothing written after a barrier
+//reaches the disk before what was written ahead of it.
+struct gpt_stage_io {
+     int fd;
+     //O_DIRECT descriptor of the same disk, -1 to write through fd
+     int direct_fd;
+     //Writes issued since the last barrier
+     uint32_t pending;
+     uint32_t blk_size;
+     //Offset of the secondary GPT header, in the last block
+     int64_t gpt2_offset;
+     //Header block and partition entry array of each GPT as last read or
+     //written, indexed by enum gpt_instance. Block size aligned.
+     uint8_t *hdr[2];
+     uint8_t *pentries[2];
+     //Allocated size of each entry array buffer
+     uint32_t pentries_size[2];
+};
+//Both GPTs of a disk as found by gpt_validate_disk(), indexed by enum
+//gpt_instance
+struct gpt_disk_state {
+     enum gpt_state hdr[2];
+     //Entry array matches the CRC in its header
+     int pentries_ok[2];
+     //Entry arrays differ, or one of them is not valid
+     int diverged;
+};
 //List of LUN's containing boot critical images.
 //Required in the case of UFS devices
 struct update_data {
      char lun_list[MAX_LUNS][PATH_MAX];
      uint32_t num_valid_entries;
 };
+//Work shared by the threads preparing the LUNs of an update_data
+struct lun_update_job {
+     enum boot_update_stage stage;
+     struct update_data *data;
+     //Result of prepare_partitions() for each LUN
+     int *rcodes;
+     //Next LUN to hand out
+     std::atomic<uint32_t> next;
+};
+
+//Operations counted by the stats, see gpt_utils_dump_stats()
+enum gpt_stat_id {
+    GPT_STAT_READ = 0,
+    GPT_STAT_WRITE,
+    GPT_STAT_FSYNC,
+    GPT_STAT_CRC,
+    //Symlink resolutions
+    GPT_STAT_LINK,
+    GPT_STAT_IOCTL,
+    //Whole prepare_partitions() and gpt_disk_commit() calls
+    GPT_STAT_PREPARE,
+    GPT_STAT_COMMIT,
+    //gpt_utils_wait_for_partitions() calls
+    GPT_STAT_WAIT,
+    GPT_STAT_MAX
+};
+struct gpt_stat {
+     std::atomic<uint64_t> count;
+     std::atomic<uint64_t> bytes;
+     //Operations counted in ns and hist
+     std::atomic<uint64_t> timed;
+     std::atomic<uint64_t> ns;
+     std::atomic<uint64_t> hist[GPT_STAT_BUCKETS];
+};
+static struct gpt_stat gpt_stats[GPT_STAT_MAX];
+//Time the operations even when not tracing, see gpt_utils_set_stats_timing()
+static std::atomic<bool> gpt_stat_timing;
+static const char * const gpt_stat_names[GPT_STAT_MAX] = {
+    "read", "write", "fsync", "crc", "link", "ioctl", "prepare", "commit", "wait"
+};
 
 /******************************************************************************
  * FUNCTIONS
  ******************************************************************************/
+//Monotonic time [ns]
+static uint64_t gpt_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//Start time of an operation counted by the stats [ns], or 0 if it is not
+//timed. Operations are only timed while the HAL category is traced or
+//timing was asked for, so that counting stays cheap otherwise.
+static uint64_t gpt_stat_start()
+{
+    if (!gpt_stat_timing.load(std::memory_order_relaxed) &&
+            !atrace_is_tag_enabled(ATRACE_TAG))
+        return 0;
+    return gpt_now_ns();
+}
+
+//Count an operation started at start that moved bytes bytes
+static void gpt_stat_add(enum gpt_stat_id id, uint64_t start, uint64_t bytes)
+{
+    struct gpt_stat *st = &gpt_stats[id];
+    uint64_t ns, us;
+    unsigned bucket;
+
+    st->count.fetch_add(1, std::memory_order_relaxed);
+    st->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    if (!start)
+        return;
+    ns = gpt_now_ns() - start;
+    us = ns / 1000;
+    bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= GPT_STAT_BUCKETS)
+        bucket = GPT_STAT_BUCKETS - 1;
+    st->timed.fetch_add(1, std::memory_order_relaxed);
+    st->ns.fetch_add(ns, std::memory_order_relaxed);
+    st->hist[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void gpt_utils_set_stats_timing(int enable)
+{
+    gpt_stat_timing.store(enable, std::memory_order_relaxed);
+}
+
+static uint32_t gpt_crc32(uint32_t crc, const void *buf, size_t size)
+{
+    uint64_t start = gpt_stat_start();
+
+    crc = sparse_crc32(crc, buf, size);
+    gpt_stat_add(GPT_STAT_CRC, start, size);
+    return crc;
+}
+
+static int gpt_fdatasync(int fd)
+{
+    uint64_t start = gpt_stat_start();
+    int r = fdatasync(fd);
+
+    gpt_stat_add(GPT_STAT_FSYNC, start, 0);
+    return r;
+}
+
+static ssize_t gpt_readlinkat(int dirfd, const char *path, char *buf,
+                              size_t bufsize)
+{
+    uint64_t start = gpt_stat_start();
+    ssize_t r = readlinkat(dirfd, path, buf, bufsize);
+
+    gpt_stat_add(GPT_STAT_LINK, start, 0);
+    return r;
+}
+
+int gpt_utils_dump_stats(int fd)
+{
+    int i, b;
+
+    if (dprintf(fd, "gpt-utils stats: op count bytes timed total_us, then "
+                "counts of timed ops taking <1us <2us <4us ... >=%uus\n",
+                1U << (GPT_STAT_BUCKETS - 2)) < 0)
+        return -1;
+    for (i = 0; i < GPT_STAT_MAX; i++) {
+        struct gpt_stat *st = &gpt_stats[i];
+
+        dprintf(fd, "%-8s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64,
+                gpt_stat_names[i],
+                st->count.load(std::memory_order_relaxed),
+                st->bytes.load(std::memory_order_relaxed),
+                st->timed.load(std::memory_order_relaxed),
+                st->ns.load(std::memory_order_relaxed) / 1000);
+        for (b = 0; b < GPT_STAT_BUCKETS; b++)
+            dprintf(fd, " %" PRIu64, st->hist[b].load(std::memory_order_relaxed));
+        dprintf(fd, "\n");
+    }
+    return 0;
+}
+
+
 /**
  *  ==========================================================================
  *
@@ -140,28 +414,43 @@ struct update_data {
  *
  *  ==========================================================================
  */
-static int blk_rw(int fd, int rw, int64_t offset, uint8_t *buf, unsigned len)
+static int blk_rw_uncounted(int fd, int rw, int64_t offset, uint8_t *buf,
+                            unsigned len)
 {
-    int r;
+    ssize_t r;
 
-    if (lseek64(fd, offset, SEEK_SET) < 0) {
-        fprintf(stderr, "block dev lseek64 %" PRId64 " failed: %s\n", offset,
-                strerror(errno));
-        return -1;
+    /* Positional I/O, retried until the whole range is transferred */
+    while (len) {
+        if (rw)
+            r = pwrite64(fd, buf, len, offset);
+        else
+            r = pread64(fd, buf, len, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            fprintf(stderr, "block dev %s at %" PRId64 " failed: %s\n",
+                    rw ? "write" : "read", offset,
+                    r < 0 ? strerror(errno) : "end of device");
+            return -1;
+        }
+        buf += r;
+        offset += r;
+        len -= r;
     }
 
-    if (rw)
-        r = write(fd, buf, len);
-    else
-        r = read(fd, buf, len);
+    return 0;
+}
 
-    if (r < 0)
-        fprintf(stderr, "block dev %s failed: %s\n", rw ? "write" : "read",
-                strerror(errno));
-    else
-        r = 0;
+//blk_rw_uncounted(), counted as a disk read or write by the stats
+static int blk_rw(int fd, int rw, int64_t offset, uint8_t *buf, unsigned len)
+{
+    uint64_t start = gpt_stat_start();
 
-    return r;
+    if (blk_rw_uncounted(fd, rw, offset, buf, len))
+        return -1;
+    gpt_stat_add(rw ? GPT_STAT_WRITE : GPT_STAT_READ, start, len);
+
+    return 0;
 }
 
 
@@ -169,40 +458,62 @@ static int blk_rw(int fd, int rw, int64_t offset, uint8_t *buf, unsigned len)
 /**
  *  ==========================================================================
  *
- *  \brief  Search within GPT for partition entry with the given name
- *  or it's backup twin (name-bak).
+ *  \brief  Opens a disk for direct writes if the backend asks for them
  *
- *  \param [in] ptn_name        Partition name to seek
- *  \param [in] pentries_start  Partition entries array start pointer
- *  \param [in] pentries_end    Partition entries array end pointer
- *  \param [in] pentry_size     Single partition entry size [bytes]
+ *  \param [in] path  disk path
  *
- *  \return  First partition entry pointer that matches the name or NULL
+ *  \return  O_DIRECT descriptor, -1 if direct I/O is not wanted or not
+ *           supported by the disk
  *
  *  ==========================================================================
  */
-static uint8_t *gpt_pentry_seek(const char *ptn_name,
-                                const uint8_t *pentries_start,
-                                const uint8_t *pentries_end,
-                                uint32_t pentry_size)
+static int blk_open_direct(const char *path)
 {
-    char *pentry_name;
-    unsigned len = strlen(ptn_name);
+    if (!backend.direct_io)
+        return -1;
+    return open(path, O_RDWR | O_DIRECT | O_CLOEXEC);
+}
 
-    for (pentry_name = (char *) (pentries_start + PARTITION_NAME_OFFSET);
-         pentry_name < (char *) pentries_end; pentry_name += pentry_size) {
-        char name8[MAX_GPT_NAME_SIZE] = {0}; // initialize with null
-        unsigned i;
 
-        /* Partition names in GPT are UTF-16 - ignoring UTF-16 2nd byte */
-        for (i = 0; i < sizeof(name8) / 2; i++)
-            name8[i] = pentry_name[i * 2];
-        if (!strncmp(ptn_name, name8, len))
-            if (name8[len] == 0 || !strcmp(&name8[len], BAK_PTN_NAME_EXT))
-                return (uint8_t *) (pentry_name - PARTITION_NAME_OFFSET);
-    }
 
-    return NULL;
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Write len bytes to block dev, bypassing the page cache if possible
+ *
+ *  Direct writes need the offset, length and buffer aligned to the logical
+ *  block size. Unaligned buffers go through an aligned copy; unaligned
+ *  ranges, and direct writes that fail, go through the page cache.
+ *
+ *  \param [in] direct_fd  O_DIRECT descriptor, or -1
+ *  \param [in] fd         page cache descriptor of the same disk
+ *  \param [in] blk_size   logical block size [bytes]
+ *  \param [in] offset     block dev offset [bytes] - write start position
+ *  \param [in] buf        Pointer to the buffer containing the data
+ *  \param [in] len        Write size in bytes
+ *
+ *  \return  0 on success
+ *
+ *  ==========================================================================
+ */
+static int blk_write(int direct_fd, int fd, uint32_t blk_size, int64_t offset,
+                     uint8_t *buf, unsigned len)
+{
+    void *bounce = NULL;
+    int r;
+
+    if (direct_fd < 0 || offset % blk_size || len % blk_size)
+        return blk_rw(fd, 1, offset, buf, len);
+    if ((uintptr_t) buf % blk_size) {
+        if (posix_memalign(&bounce, blk_size, len))
+            return blk_rw(fd, 1, offset, buf, len);
+        memcpy(bounce, buf, len);
+    }
+    r = blk_rw(direct_fd, 1, offset, bounce ? (uint8_t *) bounce : buf, len);
+    free(bounce);
+    if (r)
+        r = blk_rw(fd, 1, offset, buf, len);
+    return r;
 }
 
 
@@ -210,57 +521,51 @@ static uint8_t *gpt_pentry_seek(const char *ptn_name,
 /**
  *  ==========================================================================
  *
- *  \brief  Swaps boot chain in GPT partition entries array
+ *  \brief  Write len bytes to block dev as part of the current stage epoch
  *
- *  \param [in] pentries_start  Partition entries array start
- *  \param [in] pentries_end    Partition entries array end
- *  \param [in] pentry_size     Single partition entry size
+ *  \param [in] io      stage the write belongs to
+ *  \param [in] offset  block dev offset [bytes] - write start position
+ *  \param [in] buf     Pointer to the buffer containing the data
+ *  \param [in] len     Write size in bytes
  *
- *  \return  0 on success, 1 if no backup partitions found
+ *  \return  0 on success
  *
  *  ==========================================================================
  */
-static int gpt_boot_chain_swap(const uint8_t *pentries_start,
-                                const uint8_t *pentries_end,
-                                uint32_t pentry_size)
+static int gpt_stage_write(struct gpt_stage_io *io, int64_t offset,
+                           uint8_t *buf, unsigned len)
 {
-    const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
-
-    int backup_not_found = 1;
-    unsigned i;
-
-    for (i = 0; i < ARRAY_SIZE(ptn_swap_list); i++) {
-        uint8_t *ptn_entry;
-        uint8_t *ptn_bak_entry;
-        uint8_t ptn_swap[PTN_ENTRY_SIZE];
-        //Skip the xbl partition on UFS devices. That is handled
-        //seperately.
-        if (gpt_utils_is_ufs_device() && !strncmp(ptn_swap_list[i],
-                                PTN_XBL,
-                                strlen(PTN_XBL)))
-            continue;
+    io->pending++;
+    return blk_write(io->direct_fd, io->fd, io->blk_size, offset, buf, len);
+}
 
-        ptn_entry = gpt_pentry_seek(ptn_swap_list[i], pentries_start,
-                        pentries_end, pentry_size);
-        if (ptn_entry == NULL)
-            continue;
 
-        ptn_bak_entry = gpt_pentry_seek(ptn_swap_list[i],
-                        ptn_entry + pentry_size, pentries_end, pentry_size);
-        if (ptn_bak_entry == NULL) {
-            fprintf(stderr, "'%s' partition not backup - skip safe update\n",
-                    ptn_swap_list[i]);
-            continue;
-        }
 
-        /* swap primary <-> backup partition entries */
-        memcpy(ptn_swap, ptn_entry, PTN_ENTRY_SIZE);
-        memcpy(ptn_entry, ptn_bak_entry, PTN_ENTRY_SIZE);
-        memcpy(ptn_bak_entry, ptn_swap, PTN_ENTRY_SIZE);
-        backup_not_found = 0;
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Close the current stage epoch
+ *
+ *  Makes the writes issued so far durable before any later one is issued.
+ *  Epochs without writes cost nothing, so stages that turn out to be no-ops
+ *  do not flush the device at all.
+ *
+ *  \param [in] io  stage to flush
+ *
+ *  \return  0 on success
+ *
+ *  ==========================================================================
+ */
+static int gpt_stage_barrier(struct gpt_stage_io *io)
+{
+    if (!io->pending)
+        return 0;
+    io->pending = 0;
+    if (gpt_fdatasync(io->fd)) {
+        fprintf(stderr, "block dev flush failed: %s\n", strerror(errno));
+        return -1;
     }
-
-    return backup_not_found;
+    return 0;
 }
 
 
@@ -268,90 +573,1514 @@ static int gpt_boot_chain_swap(const uint8_t *pentries_start,
 /**
  *  ==========================================================================
  *
- *  \brief  Sets secondary GPT boot chain
+ *  \brief  Read a contiguous block dev range into several buffers
  *
- *  \param [in] fd    block dev file descriptor
- *  \param [in] boot  Boot chain to switch to
+ *  \param [in] fd      block dev file descriptor (returned from open)
+ *  \param [in] offset  block dev offset [bytes] - read start position
+ *  \param [in] iov     Buffers to fill in order; modified on short reads
+ *  \param [in] iovcnt  Number of buffers
  *
  *  \return  0 on success
  *
  *  ==========================================================================
  */
-static int gpt2_set_boot_chain(int fd, enum boot_chain boot)
+static int blk_readv(int fd, int64_t offset, struct iovec *iov, int iovcnt)
 {
-    int64_t  gpt2_header_offset;
-    uint64_t pentries_start_offset;
-    uint32_t gpt_header_size;
-    uint32_t pentry_size;
-    uint32_t pentries_array_size;
-
-    uint8_t *gpt_header = NULL;
-    uint8_t  *pentries = NULL;
-    uint32_t crc;
-    uint32_t blk_size = 0;
-    int r;
+    uint64_t start = gpt_stat_start();
+    int64_t first = offset;
+    ssize_t r;
 
-    if (ioctl(fd, BLKSSZGET, &blk_size) != 0) {
-            fprintf(stderr, "Failed to get GPT device block size: %s\n",
-                            strerror(errno));
-            r = -1;
-            goto EXIT;
-    }
-    gpt_header = (uint8_t*)malloc(blk_size);
-    if (!gpt_header) {
-            fprintf(stderr, "Failed to allocate memory to hold GPT block\n");
-            r = -1;
-            goto EXIT;
-    }
-    gpt2_header_offset = lseek64(fd, 0, SEEK_END) - blk_size;
-    if (gpt2_header_offset < 0) {
-        fprintf(stderr, "Getting secondary GPT header offset failed: %s\n",
-                strerror(errno));
-        r = -1;
-        goto EXIT;
+    while (iovcnt) {
+        r = preadv64(fd, iov, iovcnt, offset);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0) {
+            fprintf(stderr, "block dev read at %" PRId64 " failed: %s\n",
+                    offset, r < 0 ? strerror(errno) : "end of device");
+            return -1;
+        }
+        offset += r;
+        /* Skip what was transferred and continue with the rest */
+        while (iovcnt && (size_t) r >= iov->iov_len) {
+            r -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt) {
+            iov->iov_base = (uint8_t *) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
     }
+    gpt_stat_add(GPT_STAT_READ, start, offset - first);
 
-    /* Read primary GPT header from block dev */
-    r = blk_rw(fd, 0, blk_size, gpt_header, blk_size);
+    return 0;
+}
 
-    if (r) {
-            fprintf(stderr, "Failed to read primary GPT header from blk dev\n");
-            goto EXIT;
-    }
-    pentries_start_offset =
-        GET_8_BYTES(gpt_header + PENTRIES_OFFSET) * blk_size;
-    pentry_size = GET_4_BYTES(gpt_header + PENTRY_SIZE_OFFSET);
-    pentries_array_size =
-        GET_4_BYTES(gpt_header + PARTITION_COUNT_OFFSET) * pentry_size;
 
-    pentries = (uint8_t *) calloc(1, pentries_array_size);
-    if (pentries == NULL) {
-        fprintf(stderr,
-                    "Failed to alloc memory for GPT partition entries array\n");
-        r = -1;
-        goto EXIT;
-    }
-    /* Read primary GPT partititon entries array from block dev */
-    r = blk_rw(fd, 0, pentries_start_offset, pentries, pentries_array_size);
-    if (r)
-        goto EXIT;
 
-    crc = crc32(0, pentries, pentries_array_size);
-    if (GET_4_BYTES(gpt_header + PARTITION_CRC_OFFSET) != crc) {
+int gpt_utils_set_backend(const struct gpt_utils_backend *cfg)
+{
+        struct gpt_backend_state state = {
+                BOOT_DEV_DIR, BLK_DEV_FILE, -1, DEFAULT_IMAGE_BLOCK_SIZE, 0,
+                "", 0, SYSFS_BLOCK_DIR, SG_DEV_DIR
+        };
+        if (cfg) {
+                if (!cfg->by_name_dir || !cfg->emmc_disk ||
+                                (cfg->image_block_size &&
+                                 (cfg->image_block_size < 512 ||
+                                  (cfg->image_block_size &
+                                   (cfg->image_block_size - 1))))) {
+                        ALOGE("%s: Invalid backend", __func__);
+                        return -1;
+                }
+                strlcpy(state.by_name_dir, cfg->by_name_dir,
+                                sizeof(state.by_name_dir));
+                strlcpy(state.emmc_disk, cfg->emmc_disk,
+                                sizeof(state.emmc_disk));
+                state.is_ufs = cfg->is_ufs;
+                if (cfg->image_block_size)
+                        state.image_block_size = cfg->image_block_size;
+                state.links_to_disks = cfg->links_to_disks;
+                if (cfg->snapshot_path)
+                        strlcpy(state.snapshot_path, cfg->snapshot_path,
+                                        sizeof(state.snapshot_path));
+                else
+                        state.snapshot_path[0] = '\0';
+                state.direct_io = cfg->direct_io;
+                if (cfg->sysfs_block_dir)
+                        strlcpy(state.sysfs_block_dir, cfg->sysfs_block_dir,
+                                        sizeof(state.sysfs_block_dir));
+                if (cfg->sg_dev_dir)
+                        strlcpy(state.sg_dev_dir, cfg->sg_dev_dir,
+                                        sizeof(state.sg_dev_dir));
+        }
+        backend = state;
+        gpt_utils_reset_topology();
+        return 0;
+}
+
+//Path of the by-name link of a partition
+static void gpt_by_name_path(const char *partname, char *buf, size_t buflen)
+{
+        snprintf(buf, buflen, "%s/%s", backend.by_name_dir, partname);
+}
+
+//stat() the by-name link of a partition
+static int gpt_by_name_stat(const char *partname, struct stat *st)
+{
+        char path[PATH_MAX];
+        gpt_by_name_path(partname, path, sizeof(path));
+        return stat(path, st);
+}
+
+//Turn the target of a by-name link, in path, into the path of the disk
+//holding the partition. For block devices this means going from
+///dev/block/sdaXXX to /dev/block/sda; image backends link to the disk
+//itself.
+static int gpt_link_to_disk(char *path, size_t buflen)
+{
+        char target[PATH_MAX];
+        if (backend.links_to_disks) {
+                if (path[0] == '/')
+                        return 0;
+                strlcpy(target, path, sizeof(target));
+                snprintf(path, buflen, "%s/%s", backend.by_name_dir, target);
+                return 0;
+        }
+        if (strlen(path) < PATH_TRUNCATE_LOC + 1)
+                return -1;
+        path[PATH_TRUNCATE_LOC] = '\0';
+        return 0;
+}
+
+//Partition name -> disk path. Looked up by string_view or C string
+//without building a string.
+typedef map<string, string, less<>> gpt_disk_map;
+
+//Resolve every link in the by-name directory to the disk holding the
+//partition in a single pass over the directory, filling disk_map with
+//partition name -> disk path.
+static int gpt_scan_by_name_dir(gpt_disk_map& disk_map)
+{
+        char real_path[PATH_MAX];
+        DIR *dir = NULL;
+        struct dirent *de;
+        ssize_t len;
+        dir = opendir(backend.by_name_dir);
+        if (!dir) {
+                fprintf(stderr, "%s: Failed to open %s(%s)\n",
+                                __func__,
+                                backend.by_name_dir,
+                                strerror(errno));
+                return -1;
+        }
+        while ((de = readdir(dir))) {
+                if (de->d_name[0] == '.' ||
+                                (de->d_type != DT_LNK &&
+                                 de->d_type != DT_UNKNOWN))
+                        continue;
+                len = gpt_readlinkat(dirfd(dir), de->d_name, real_path,
+                                sizeof(real_path) - 1);
+                if (len < 0)
+                        continue;
+                real_path[len] = '\0';
+                if (gpt_link_to_disk(real_path, sizeof(real_path)))
+                        continue;
+                disk_map[de->d_name] = real_path;
+        }
+        closedir(dir);
+        return 0;
+}
+
+//Boot device topology, derived on first use and reused until the by-name
+//directory changes, as found by topo_changed_locked(), or
+//gpt_utils_reset_topology() is called. topo_lock protects all of it but
+//the atomics.
+static pthread_mutex_t topo_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t topo_atfork_once = PTHREAD_ONCE_INIT;
+//Cached property based gpt_utils_is_ufs_device() result, -1 if unknown
+static std::atomic<int> topo_is_ufs(-1);
+//Set when the cached links may be out of date
+static std::atomic<bool> topo_stale(false);
+//Non-blocking inotify instance, drained before cached links are used, and
+//its watch on the by-name directory
+static int topo_inotify_fd = -1;
+static int topo_wd = -1;
+//Partition name -> disk holding it, NULL until scanned
+static shared_ptr<const gpt_disk_map> topo_disks;
+//by-name link -> scsi generic node of the disk it points into
+static map<string, string> topo_sg_nodes;
+
+//Whether the cached links may be out of date, draining the events of the
+//by-name directory watch. Called with topo_lock held.
+static bool topo_changed_locked()
+{
+        char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        ssize_t len;
+        if (topo_inotify_fd < 0)
+                return topo_stale;
+        for (;;) {
+                len = read(topo_inotify_fd, buf, sizeof(buf));
+                if (len < 0 && errno == EINTR)
+                        continue;
+                if (len <= 0)
+                        break;
+                for (char *p = buf; p < buf + len;
+                                p += sizeof(struct inotify_event) + ev->len) {
+                        ev = (const struct inotify_event *)p;
+                        //Removing a watch is not a change of the links
+                        if (ev->mask != IN_IGNORED)
+                                topo_stale = true;
+                }
+        }
+        //The queue overflowed or the instance broke: nothing is known
+        if (len == 0 || errno != EAGAIN)
+                topo_stale = true;
+        return topo_stale;
+}
+
+//fork() handlers: the child must not share the parent's inotify instance,
+//whose events only one of them would see, so it starts over
+static void topo_atfork_prepare()
+{
+        pthread_mutex_lock(&topo_lock);
+}
+
+static void topo_atfork_parent()
+{
+        pthread_mutex_unlock(&topo_lock);
+}
+
+static void topo_atfork_child()
+{
+        if (topo_inotify_fd >= 0)
+                close(topo_inotify_fd);
+        topo_inotify_fd = -1;
+        topo_wd = -1;
+        topo_stale = true;
+        pthread_mutex_unlock(&topo_lock);
+}
+
+static void topo_register_atfork()
+{
+        pthread_atfork(topo_atfork_prepare, topo_atfork_parent,
+                        topo_atfork_child);
+}
+
+//Make sure the by-name directory is watched, so that cached links get
+//dropped when it changes. Called with topo_lock held. Returns 0 if the
+//directory is being watched.
+static int topo_watch_locked()
+{
+        if (topo_wd >= 0)
+                return 0;
+        if (topo_inotify_fd < 0) {
+                pthread_once(&topo_atfork_once, topo_register_atfork);
+                topo_inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+                if (topo_inotify_fd < 0)
+                        return -1;
+        }
+        //Watching the same directory again keeps the existing watch
+        topo_wd = inotify_add_watch(topo_inotify_fd, backend.by_name_dir,
+                        IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                        IN_DELETE_SELF | IN_MOVE_SELF);
+        return topo_wd < 0 ? -1 : 0;
+}
+
+//Drop the cached links. Called with topo_lock held.
+static void topo_drop_locked()
+{
+        topo_stale = false;
+        topo_disks.reset();
+        topo_sg_nodes.clear();
+        //The directory may have been replaced, look it up again
+        topo_wd = -1;
+}
+
+void gpt_utils_reset_topology()
+{
+        pthread_mutex_lock(&topo_lock);
+        if (topo_wd >= 0)
+                inotify_rm_watch(topo_inotify_fd, topo_wd);
+        topo_drop_locked();
+        topo_is_ufs = -1;
+        pthread_mutex_unlock(&topo_lock);
+}
+
+//Watch the by-name directory for new links or, while it doesn't exist,
+//the closest existing directory above it for the next path component.
+//Returns the watch descriptor, setting *on_dir if it is on the by-name
+//directory itself, or -1.
+static int gpt_wait_watch(int fd, int *on_dir)
+{
+        char path[PATH_MAX];
+        char *slash;
+        int wd;
+        strlcpy(path, backend.by_name_dir, sizeof(path));
+        wd = inotify_add_watch(fd, path, IN_CREATE | IN_MOVED_TO |
+                        IN_DELETE_SELF | IN_MOVE_SELF);
+        *on_dir = wd >= 0;
+        while (wd < 0 && (slash = strrchr(path, '/'))) {
+                //Keep the / of the root directory
+                slash[slash == path] = '\0';
+                wd = inotify_add_watch(fd, path, IN_CREATE | IN_MOVED_TO |
+                                IN_DELETE_SELF | IN_MOVE_SELF);
+                if (slash == path)
+                        break;
+        }
+        return wd;
+}
+
+int gpt_utils_wait_for_partitions(const char * const *partnames,
+                uint32_t count,
+                int timeout_ms)
+{
+        vector<const char *> missing;
+        char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+        const struct inotify_event *ev;
+        uint64_t start = gpt_now_ns();
+        uint64_t stat_start = gpt_stat_start();
+        struct pollfd pfd = { -1, POLLIN, 0 };
+        struct stat st;
+        int64_t left_ms;
+        ssize_t len;
+        int wd = -1;
+        int on_dir = 0;
+        int armed = 0;
+        int r = -1;
+        if (!partnames && count) {
+                ALOGE("%s: Invalid argument", __func__);
+                errno = EINVAL;
+                return -1;
+        }
+        ATRACE_BEGIN("gpt-utils: wait for partitions");
+        missing.assign(partnames, partnames + count);
+        for (;;) {
+                for (size_t i = 0; i < missing.size();) {
+                        if (!gpt_by_name_stat(missing[i], &st)) {
+                                missing[i] = missing.back();
+                                missing.pop_back();
+                        } else {
+                                i++;
+                        }
+                }
+                if (missing.empty()) {
+                        r = 0;
+                        break;
+                }
+                //Look again once watching, so that links created in
+                //between are not missed
+                if (!armed) {
+                        if (pfd.fd < 0)
+                                pfd.fd = inotify_init1(IN_NONBLOCK |
+                                                IN_CLOEXEC);
+                        if (pfd.fd >= 0 && wd >= 0)
+                                inotify_rm_watch(pfd.fd, wd);
+                        wd = pfd.fd < 0 ? -1 :
+                                gpt_wait_watch(pfd.fd, &on_dir);
+                        if (wd < 0) {
+                                ALOGE("%s: Failed to watch %s: %s",
+                                                __func__,
+                                                backend.by_name_dir,
+                                                strerror(errno));
+                                break;
+                        }
+                        armed = 1;
+                        continue;
+                }
+                left_ms = timeout_ms;
+                if (timeout_ms >= 0) {
+                        left_ms -= (gpt_now_ns() - start) / 1000000;
+                        if (left_ms <= 0) {
+                                errno = ETIMEDOUT;
+                                break;
+                        }
+                }
+                //A link on the way to the by-name directory may point to a
+                //directory that appears below the watched one, so look
+                //again now and then until the directory itself is watched
+                if (!on_dir && (left_ms < 0 ||
+                                        left_ms > GPT_WAIT_ANCESTOR_RECHECK_MS))
+                        left_ms = GPT_WAIT_ANCESTOR_RECHECK_MS;
+                if (poll(&pfd, 1, left_ms) < 0 && errno != EINTR) {
+                        ALOGE("%s: poll failed: %s", __func__,
+                                        strerror(errno));
+                        break;
+                }
+                while ((len = read(pfd.fd, buf, sizeof(buf))) > 0) {
+                        for (char *p = buf; p < buf + len;
+                                        p += sizeof(struct inotify_event) +
+                                        ev->len) {
+                                ev = (const struct inotify_event *)p;
+                                //The directory went away, watch its
+                                //parent until it is back
+                                if (ev->mask & (IN_IGNORED | IN_DELETE_SELF |
+                                                        IN_MOVE_SELF))
+                                        on_dir = 0;
+                        }
+                }
+                //Anything showing up above the by-name directory may
+                //complete the path to it
+                if (!on_dir)
+                        armed = 0;
+        }
+        if (pfd.fd >= 0)
+                close(pfd.fd);
+        //Make sure the next lookup sees the links waited for, whatever the
+        //state of the topology cache's own watch
+        if (!r && wd >= 0)
+                topo_stale = true;
+        gpt_stat_add(GPT_STAT_WAIT, stat_start, 0);
+        ATRACE_END();
+        return r;
+}
+
+//Process local view of the snapshot file, protected by snap_lock
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *snap_base;
+static size_t snap_size;
+static dev_t snap_dev;
+static ino_t snap_ino;
+static char snap_boot_id[GPT_SNAPSHOT_BOOT_ID_SIZE];
+
+//Read the id of this boot, once. Called with snap_lock held.
+static int snap_boot_id_locked()
+{
+        ssize_t len;
+        int fd;
+        if (snap_boot_id[0])
+                return 0;
+        fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+        len = read(fd, snap_boot_id, sizeof(snap_boot_id) - 1);
+        close(fd);
+        if (len <= 0) {
+                snap_boot_id[0] = '\0';
+                return -1;
+        }
+        snap_boot_id[len] = '\0';
+        snap_boot_id[strcspn(snap_boot_id, "\n")] = '\0';
+        return 0;
+}
+
+static void snap_unmap_locked()
+{
+        if (snap_base)
+                munmap(snap_base, snap_size);
+        snap_base = NULL;
+        snap_size = 0;
+}
+
+static const char *snap_path(const struct gpt_snapshot_hdr *hdr, uint32_t i)
+{
+        return (const char *)(hdr + 1) + i * GPT_SNAPSHOT_PATH_SIZE;
+}
+
+static const struct gpt_snapshot_link *snap_links(
+                const struct gpt_snapshot_hdr *hdr)
+{
+        return (const struct gpt_snapshot_link *)
+                snap_path(hdr, hdr->num_paths);
+}
+
+static const uint8_t *snap_disks(const struct gpt_snapshot_hdr *hdr)
+{
+        return (const uint8_t *)(snap_links(hdr) + hdr->num_links);
+}
+
+//CRC of a snapshot file with its crc field taken as 0
+static uint32_t snap_crc(const uint8_t *buf, uint32_t size)
+{
+        const uint32_t zero = 0;
+        size_t off = offsetof(struct gpt_snapshot_hdr, crc);
+        uint32_t crc;
+        //Not a GPT CRC, so left out of the stats
+        crc = sparse_crc32(0, buf, off);
+        crc = sparse_crc32(crc, &zero, sizeof(zero));
+        return sparse_crc32(crc, buf + off + sizeof(zero),
+                        size - off - sizeof(zero));
+}
+
+//Check that the mapped snapshot is complete, consistent and taken
+//during this boot
+static int snap_verify_locked()
+{
+        const struct gpt_snapshot_hdr *hdr =
+                (const struct gpt_snapshot_hdr *)snap_base;
+        const struct gpt_snapshot_disk *rec;
+        const uint8_t *p;
+        uint64_t tables_size;
+        if (hdr->magic != GPT_SNAPSHOT_MAGIC ||
+                        hdr->version != GPT_SNAPSHOT_VERSION ||
+                        hdr->size != snap_size ||
+                        strncmp(hdr->boot_id, snap_boot_id,
+                                sizeof(hdr->boot_id)) ||
+                        snap_crc(snap_base, hdr->size) != hdr->crc)
+                return -1;
+        if (sizeof(*hdr) + (uint64_t)hdr->num_paths * GPT_SNAPSHOT_PATH_SIZE +
+                        (uint64_t)hdr->num_links *
+                        sizeof(struct gpt_snapshot_link) > snap_size)
+                return -1;
+        for (uint32_t i = 0; i < hdr->num_links; i++)
+                if (snap_links(hdr)[i].path >= hdr->num_paths)
+                        return -1;
+        p = snap_disks(hdr);
+        for (uint32_t i = 0; i < hdr->num_disks; i++) {
+                rec = (const struct gpt_snapshot_disk *)p;
+                if ((size_t)(snap_base + snap_size - p) < sizeof(*rec))
+                        return -1;
+                tables_size = sizeof(*rec) + 2 * (uint64_t)rec->block_size +
+                        rec->arr_size + rec->arr_bak_size;
+                if (rec->path >= hdr->num_paths || rec->size % 8 ||
+                                rec->size < tables_size ||
+                                rec->size > (size_t)(snap_base +
+                                        snap_size - p))
+                        return -1;
+                p += rec->size;
+        }
+        return 0;
+}
+
+//Map the current snapshot file if it is valid, or keep using the one
+//already mapped if it has not been replaced since. Called with snap_lock
+//held. Returns the snapshot or NULL.
+static const struct gpt_snapshot_hdr *snap_map_locked()
+{
+        struct stat st;
+        void *base;
+        int fd;
+        if (!backend.snapshot_path[0] || snap_boot_id_locked())
+                return NULL;
+        if (stat(backend.snapshot_path, &st)) {
+                snap_unmap_locked();
+                return NULL;
+        }
+        if (snap_base && st.st_dev == snap_dev && st.st_ino == snap_ino)
+                return (const struct gpt_snapshot_hdr *)snap_base;
+        snap_unmap_locked();
+        fd = open(backend.snapshot_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return NULL;
+        if (fstat(fd, &st) ||
+                        st.st_size < (off_t)sizeof(struct gpt_snapshot_hdr) ||
+                        st.st_size > GPT_SNAPSHOT_MAX_SIZE) {
+                close(fd);
+                return NULL;
+        }
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+                return NULL;
+        snap_base = (uint8_t *)base;
+        snap_size = st.st_size;
+        snap_dev = st.st_dev;
+        snap_ino = st.st_ino;
+        if (snap_verify_locked()) {
+                ALOGE("%s: Ignoring invalid snapshot %s", __func__,
+                                backend.snapshot_path);
+                snap_unmap_locked();
+                return NULL;
+        }
+        return (const struct gpt_snapshot_hdr *)snap_base;
+}
+
+//Serialize snapshot updates against GPT updates across processes. GPT
+//updates hold the lock shared, loads that may publish a snapshot hold it
+//exclusively, so nothing read while a GPT was being written gets
+//published. Loads only try the lock (LOCK_EX | LOCK_NB) and neither use
+//nor publish the snapshot if it is held: an update holding it may be
+//running in the calling process itself, eg: prepare_partitions() looking
+//up links. Returns a descriptor for gpt_snapshot_unlock() or -1.
+static int gpt_snapshot_lock(int op)
+{
+        char path[PATH_MAX];
+        int fd;
+        if (!backend.snapshot_path[0])
+                return -1;
+        snprintf(path, sizeof(path), "%s.lock", backend.snapshot_path);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0)
+                return -1;
+        while (flock(fd, op)) {
+                if (errno != EINTR) {
+                        close(fd);
+                        return -1;
+                }
+        }
+        return fd;
+}
+
+static void gpt_snapshot_unlock(int fd)
+{
+        if (fd >= 0)
+                close(fd);
+}
+
+//Drop the snapshot before writing to a GPT
+static void gpt_snapshot_invalidate()
+{
+        if (!backend.snapshot_path[0])
+                return;
+        pthread_mutex_lock(&snap_lock);
+        unlink(backend.snapshot_path);
+        snap_unmap_locked();
+        pthread_mutex_unlock(&snap_lock);
+}
+
+//Fill the tables of disk, opened but not loaded yet, from the snapshot,
+//without reading the disk. Library GPT updates drop the snapshot before
+//writing, so it only goes stale if something else writes a GPT during the
+//boot. Returns 0 if the snapshot had the tables.
+static int gpt_snapshot_load_disk(struct gpt_disk *disk)
+{
+        const struct gpt_snapshot_hdr *hdr;
+        const struct gpt_snapshot_disk *rec = NULL;
+        uint32_t bs = disk->block_size;
+        const uint8_t *p;
+        int r = -1;
+        if (!backend.snapshot_path[0])
+                return -1;
+        pthread_mutex_lock(&snap_lock);
+        hdr = snap_map_locked();
+        if (!hdr)
+                goto unlock;
+        p = snap_disks(hdr);
+        for (uint32_t i = 0; i < hdr->num_disks; i++) {
+                rec = (const struct gpt_snapshot_disk *)p;
+                if (!strncmp(snap_path(hdr, rec->path), disk->devpath,
+                                        GPT_SNAPSHOT_PATH_SIZE))
+                        break;
+                p += rec->size;
+                rec = NULL;
+        }
+        if (!rec || rec->block_size != bs ||
+                        rec->dev_size != disk->dev_size)
+                goto unlock;
+        p = (const uint8_t *)(rec + 1);
+        disk->hdr = (uint8_t*)malloc(bs);
+        disk->hdr_bak = (uint8_t*)malloc(bs);
+        disk->pentry_arr = (uint8_t*)malloc(rec->arr_size);
+        disk->pentry_arr_bak = (uint8_t*)malloc(rec->arr_bak_size);
+        if (!disk->hdr || !disk->hdr_bak || !disk->pentry_arr ||
+                        !disk->pentry_arr_bak)
+                goto unlock;
+        memcpy(disk->hdr, p, bs);
+        memcpy(disk->hdr_bak, p + bs, bs);
+        p += 2 * bs;
+        memcpy(disk->pentry_arr, p, rec->arr_size);
+        p += rec->arr_size;
+        memcpy(disk->pentry_arr_bak, p, rec->arr_bak_size);
+        r = 0;
+unlock:
+        pthread_mutex_unlock(&snap_lock);
+        if (r) {
+                free(disk->hdr);
+                free(disk->hdr_bak);
+                free(disk->pentry_arr);
+                free(disk->pentry_arr_bak);
+                disk->hdr = disk->hdr_bak = NULL;
+                disk->pentry_arr = disk->pentry_arr_bak = NULL;
+        }
+        return r;
+}
+
+//Look up the links read from dir, whose status is dir_st, in the
+//snapshot. Returns 0 and fills disks if the snapshot has them.
+static int gpt_snapshot_load_links(const char *dir, const struct stat *dir_st,
+                gpt_disk_map& disks)
+{
+        const struct gpt_snapshot_hdr *hdr;
+        const struct gpt_snapshot_link *link;
+        int r = -1;
+        pthread_mutex_lock(&snap_lock);
+        hdr = snap_map_locked();
+        if (!hdr || !hdr->by_name_dir[0] ||
+                        strncmp(hdr->by_name_dir, dir,
+                                sizeof(hdr->by_name_dir)) ||
+                        hdr->dir_mtime_sec != dir_st->st_mtim.tv_sec ||
+                        hdr->dir_mtime_nsec != dir_st->st_mtim.tv_nsec)
+                goto out;
+        link = snap_links(hdr);
+        for (uint32_t i = 0; i < hdr->num_links; i++, link++)
+                disks[string(link->name, strnlen(link->name,
+                                        sizeof(link->name)))] =
+                        string(snap_path(hdr, link->path),
+                                        strnlen(snap_path(hdr, link->path),
+                                                GPT_SNAPSHOT_PATH_SIZE));
+        r = 0;
+out:
+        pthread_mutex_unlock(&snap_lock);
+        return r;
+}
+
+//Index of path in paths, adding it if needed. -1 if it doesn't fit.
+static int64_t snap_intern_path(vector<string>& paths, const string& path)
+{
+        if (path.size() >= GPT_SNAPSHOT_PATH_SIZE)
+                return -1;
+        for (size_t i = 0; i < paths.size(); i++)
+                if (paths[i] == path)
+                        return i;
+        paths.push_back(path);
+        return paths.size() - 1;
+}
+
+//Replace the snapshot with one holding what the current one has, plus the
+//tables of disk and the links read from dir (whose status is dir_st), each
+//if not NULL. Must be called with gpt_snapshot_lock(LOCK_EX) held.
+static void gpt_snapshot_publish(const struct gpt_disk *disk,
+                const char *dir,
+                const struct stat *dir_st,
+                const gpt_disk_map *links)
+{
+        const struct gpt_snapshot_hdr *old;
+        const struct gpt_snapshot_disk *rec;
+        struct gpt_snapshot_hdr hdr;
+        struct gpt_snapshot_disk new_rec;
+        vector<string> paths;
+        vector<struct gpt_snapshot_link> new_links;
+        vector<uint8_t> disks;
+        vector<uint8_t> buf;
+        char tmp[PATH_MAX];
+        const uint8_t *p;
+        int64_t idx;
+        size_t off;
+        int fd;
+
+        pthread_mutex_lock(&snap_lock);
+        if (snap_boot_id_locked())
+                goto out;
+        old = snap_map_locked();
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = GPT_SNAPSHOT_MAGIC;
+        hdr.version = GPT_SNAPSHOT_VERSION;
+        strlcpy(hdr.boot_id, snap_boot_id, sizeof(hdr.boot_id));
+        //Links: the new ones, or else the ones already there
+        if (links && strlen(dir) < sizeof(hdr.by_name_dir)) {
+                strlcpy(hdr.by_name_dir, dir, sizeof(hdr.by_name_dir));
+                hdr.dir_mtime_sec = dir_st->st_mtim.tv_sec;
+                hdr.dir_mtime_nsec = dir_st->st_mtim.tv_nsec;
+                for (gpt_disk_map::const_iterator it = links->begin();
+                                it != links->end(); it++) {
+                        struct gpt_snapshot_link link;
+                        idx = snap_intern_path(paths, it->second);
+                        //All or nothing, a missing link would read as a
+                        //missing partition
+                        if (idx < 0 || it->first.size() >= sizeof(link.name)) {
+                                hdr.by_name_dir[0] = '\0';
+                                new_links.clear();
+                                break;
+                        }
+                        memset(&link, 0, sizeof(link));
+                        strlcpy(link.name, it->first.c_str(),
+                                        sizeof(link.name));
+                        link.path = idx;
+                        new_links.push_back(link);
+                }
+        } else if (old && old->by_name_dir[0]) {
+                memcpy(hdr.by_name_dir, old->by_name_dir,
+                                sizeof(hdr.by_name_dir));
+                hdr.dir_mtime_sec = old->dir_mtime_sec;
+                hdr.dir_mtime_nsec = old->dir_mtime_nsec;
+                for (uint32_t i = 0; i < old->num_links; i++) {
+                        struct gpt_snapshot_link link = snap_links(old)[i];
+                        link.path = snap_intern_path(paths,
+                                        string(snap_path(old, link.path),
+                                                strnlen(snap_path(old,
+                                                                link.path),
+                                                        GPT_SNAPSHOT_PATH_SIZE)));
+                        new_links.push_back(link);
+                }
+        }
+        //Disks: the ones already there, except the one being replaced
+        p = old ? snap_disks(old) : NULL;
+        for (uint32_t i = 0; old && i < old->num_disks; i++, p += rec->size) {
+                rec = (const struct gpt_snapshot_disk *)p;
+                string path(snap_path(old, rec->path),
+                                strnlen(snap_path(old, rec->path),
+                                        GPT_SNAPSHOT_PATH_SIZE));
+                if (disk && path == disk->devpath)
+                        continue;
+                new_rec = *rec;
+                new_rec.path = snap_intern_path(paths, path);
+                off = disks.size();
+                disks.insert(disks.end(), p, p + rec->size);
+                memcpy(&disks[off], &new_rec, sizeof(new_rec));
+        }
+        if (disk && (idx = snap_intern_path(paths, disk->devpath)) >= 0) {
+                uint32_t arr_bak_size =
+                        GET_4_BYTES(disk->hdr_bak + PARTITION_COUNT_OFFSET) *
+                        GET_4_BYTES(disk->hdr_bak + PENTRY_SIZE_OFFSET);
+                if (arr_bak_size < disk->pentry_arr_size)
+                        arr_bak_size = disk->pentry_arr_size;
+                memset(&new_rec, 0, sizeof(new_rec));
+                new_rec.path = idx;
+                new_rec.block_size = disk->block_size;
+                new_rec.dev_size = disk->dev_size;
+                new_rec.arr_size = disk->pentry_arr_size;
+                new_rec.arr_bak_size = arr_bak_size;
+                new_rec.size = (sizeof(new_rec) + 2 * disk->block_size +
+                                new_rec.arr_size + arr_bak_size + 7) & ~7u;
+                off = disks.size();
+                disks.resize(off + new_rec.size);
+                memcpy(&disks[off], &new_rec, sizeof(new_rec));
+                off += sizeof(new_rec);
+                memcpy(&disks[off], disk->hdr, disk->block_size);
+                off += disk->block_size;
+                memcpy(&disks[off], disk->hdr_bak, disk->block_size);
+                off += disk->block_size;
+                memcpy(&disks[off], disk->pentry_arr, new_rec.arr_size);
+                off += new_rec.arr_size;
+                memcpy(&disks[off], disk->pentry_arr_bak, arr_bak_size);
+        }
+        hdr.num_paths = paths.size();
+        hdr.num_links = new_links.size();
+        hdr.num_disks = 0;
+        for (off = 0; off < disks.size(); hdr.num_disks++)
+                off += ((const struct gpt_snapshot_disk *)&disks[off])->size;
+        hdr.size = sizeof(hdr) + paths.size() * GPT_SNAPSHOT_PATH_SIZE +
+                new_links.size() * sizeof(struct gpt_snapshot_link) +
+                disks.size();
+        if (hdr.size > GPT_SNAPSHOT_MAX_SIZE)
+                goto out;
+        buf.resize(hdr.size);
+        off = sizeof(hdr);
+        for (size_t i = 0; i < paths.size(); i++) {
+                strlcpy((char *)&buf[off], paths[i].c_str(),
+                                GPT_SNAPSHOT_PATH_SIZE);
+                off += GPT_SNAPSHOT_PATH_SIZE;
+        }
+        if (!new_links.empty())
+                memcpy(&buf[off], new_links.data(),
+                                new_links.size() * sizeof(new_links[0]));
+        off += new_links.size() * sizeof(struct gpt_snapshot_link);
+        if (!disks.empty())
+                memcpy(&buf[off], disks.data(), disks.size());
+        memcpy(&buf[0], &hdr, sizeof(hdr));
+        hdr.crc = snap_crc(buf.data(), hdr.size);
+        memcpy(&buf[0], &hdr, sizeof(hdr));
+        //Readers only ever see complete files
+        snprintf(tmp, sizeof(tmp), "%s.%d", backend.snapshot_path, getpid());
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0)
+                goto out;
+        //Not disk I/O, so left out of the stats
+        if (blk_rw_uncounted(fd, 1, 0, buf.data(), buf.size()) ||
+                        rename(tmp, backend.snapshot_path))
+                unlink(tmp);
+        close(fd);
+out:
+        pthread_mutex_unlock(&snap_lock);
+}
+
+
+
+//Partition name -> disk map of the by-name directory, NULL if the
+//directory can't be read. It is only kept for later calls while the
+//directory is being watched.
+static shared_ptr<const gpt_disk_map> topo_get_disks()
+{
+        shared_ptr<const gpt_disk_map> disks;
+        shared_ptr<gpt_disk_map> scan;
+        struct stat dir_st;
+        int lock_fd;
+        int watched;
+        pthread_mutex_lock(&topo_lock);
+        if (topo_changed_locked())
+                topo_drop_locked();
+        disks = topo_disks;
+        if (!disks) {
+                //Watch first so that changes made while scanning are seen
+                watched = !topo_watch_locked();
+                scan = make_shared<gpt_disk_map>();
+                memset(&dir_st, 0, sizeof(dir_st));
+                //Another process may have scanned the directory as it is
+                if (!stat(backend.by_name_dir, &dir_st) &&
+                                !gpt_snapshot_load_links(backend.by_name_dir,
+                                        &dir_st, *scan)) {
+                        disks = scan;
+                } else if (!gpt_scan_by_name_dir(*scan)) {
+                        disks = scan;
+                        lock_fd = gpt_snapshot_lock(LOCK_EX | LOCK_NB);
+                        if (lock_fd >= 0 && dir_st.st_mtim.tv_sec)
+                                gpt_snapshot_publish(NULL,
+                                                backend.by_name_dir,
+                                                &dir_st,
+                                                scan.get());
+                        gpt_snapshot_unlock(lock_fd);
+                }
+                if (disks && watched)
+                        topo_disks = disks;
+        }
+        pthread_mutex_unlock(&topo_lock);
+        return disks;
+}
+
+//Whether partname has a by-name link, looked up in the cached disk map
+//when there is one
+static int gpt_by_name_exists(const char *partname)
+{
+        shared_ptr<const gpt_disk_map> disks = topo_get_disks();
+        struct stat st;
+        if (disks)
+                return disks->count(partname) != 0;
+        return !gpt_by_name_stat(partname, &st);
+}
+
+
+
+//Get the block size of the disk represented by decsriptor fd
+static uint32_t gpt_get_block_size(int fd)
+{
+        uint32_t block_size = 0;
+        uint64_t start;
+        int rc;
+        struct stat st;
+        if (fd < 0) {
+                ALOGE("%s: invalid descriptor",
+                                __func__);
+                goto error;
+        }
+        //Image files have no sector size of their own
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode))
+                return backend.image_block_size;
+        start = gpt_stat_start();
+        rc = ioctl(fd, BLKSSZGET, &block_size);
+        gpt_stat_add(GPT_STAT_IOCTL, start, 0);
+        if (rc != 0) {
+                ALOGE("%s: Failed to get GPT dev block size : %s",
+                                __func__,
+                                strerror(errno));
+                goto error;
+        }
+        return block_size;
+error:
+        return 0;
+}
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Sets up a stage on an opened block dev
+ *
+ *  Gets the block dev geometry and the header buffers once for all the
+ *  operations of the stage.
+ *
+ *  \param [out] io       stage to set up, released with gpt_stage_release()
+ *  \param [in] fd        block dev file descriptor
+ *  \param [in] dev_path  block dev path, reopened for direct writes
+ *
+ *  \return  0 on success
+ *
+ *  ==========================================================================
+ */
+static int gpt_stage_init(struct gpt_stage_io *io, int fd, const char *dev_path)
+{
+    void *buf;
+    int gpt;
+
+    memset(io, 0, sizeof(*io));
+    io->fd = fd;
+    io->direct_fd = blk_open_direct(dev_path);
+    io->blk_size = gpt_get_block_size(fd);
+    if (!io->blk_size) {
+        fprintf(stderr, "Failed to get GPT device block size\n");
+        return -1;
+    }
+    io->gpt2_offset = lseek64(fd, 0, SEEK_END) - io->blk_size;
+    if (io->gpt2_offset < io->blk_size) {
+        fprintf(stderr, "Getting secondary GPT header offset failed: %s\n",
+                strerror(errno));
+        return -1;
+    }
+    for (gpt = PRIMARY_GPT; gpt <= SECONDARY_GPT; gpt++) {
+        if (posix_memalign(&buf, io->blk_size, io->blk_size)) {
+            fprintf(stderr, "Failed to allocate memory to hold GPT block\n");
+            return -1;
+        }
+        io->hdr[gpt] = (uint8_t *) buf;
+    }
+    return 0;
+}
+
+
+
+static void gpt_stage_release(struct gpt_stage_io *io)
+{
+    int gpt;
+
+    if (io->direct_fd >= 0)
+        close(io->direct_fd);
+    io->direct_fd = -1;
+    for (gpt = PRIMARY_GPT; gpt <= SECONDARY_GPT; gpt++) {
+        free(io->hdr[gpt]);
+        free(io->pentries[gpt]);
+        io->hdr[gpt] = NULL;
+        io->pentries[gpt] = NULL;
+        io->pentries_size[gpt] = 0;
+    }
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Gets the stage's partition entry array buffer of a GPT
+ *
+ *  Grown to whole blocks on first use; later uses within the stage reuse
+ *  it. The content is lost when the buffer grows.
+ *
+ *  \param [in] io    stage
+ *  \param [in] gpt   GPT the entry array belongs to
+ *  \param [in] size  Partition entry array size [bytes]
+ *
+ *  \return  Buffer of at least size bytes, NULL on failure
+ *
+ *  ==========================================================================
+ */
+static uint8_t *gpt_stage_pentries(struct gpt_stage_io *io,
+                                   enum gpt_instance gpt, uint32_t size)
+{
+    uint32_t alloc = DIV_ROUND_UP(size, io->blk_size) * io->blk_size;
+    void *buf;
+
+    if (io->pentries_size[gpt] >= size)
+        return io->pentries[gpt];
+    if (!alloc || posix_memalign(&buf, io->blk_size, alloc)) {
+        fprintf(stderr,
+                "Failed to alloc memory for GPT partition entries array\n");
+        return NULL;
+    }
+    free(io->pentries[gpt]);
+    io->pentries[gpt] = (uint8_t *) buf;
+    io->pentries_size[gpt] = alloc;
+    return io->pentries[gpt];
+}
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Narrows a UTF-16 GPT partition name to 8 bits
+ *
+ *  Partition names in GPT are UTF-16, the second byte of each code unit is
+ *  ignored. The first 32 code units are narrowed 16 at a time.
+ *
+ *  \param [in] name16  Partition name field of an entry
+ *  \param [out] name8  Narrowed name, MAX_GPT_NAME8_SIZE bytes
+ *
+ *  \return  Length of the narrowed name
+ *
+ *  ==========================================================================
+ */
+static size_t gpt_name_narrow(const uint8_t *name16, char *name8)
+{
+    uint32_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i low = _mm_set1_epi16(0xff);
+
+    for (; i + 16 <= MAX_GPT_NAME8_SIZE - 1; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (name16 + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *) (name16 + i * 2 + 16));
+
+        /* Mask the second bytes off so packing doesn't saturate */
+        _mm_storeu_si128((__m128i *) (name8 + i),
+                         _mm_packus_epi16(_mm_and_si128(a, low),
+                                          _mm_and_si128(b, low)));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= MAX_GPT_NAME8_SIZE - 1; i += 16)
+        vst1q_u8((uint8_t *) name8 + i, vld2q_u8(name16 + i * 2).val[0]);
+#endif
+    for (; i < MAX_GPT_NAME8_SIZE - 1; i++)
+        name8[i] = name16[i * 2];
+    name8[MAX_GPT_NAME8_SIZE - 1] = '\0';
+    return strlen(name8);
+}
+
+
+
+static uint32_t gpt_name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (uint8_t) *name++) * 16777619u;
+    return h;
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Builds the name index of a GPT partition entries array
+ *
+ *  \param [out] index          Index to build
+ *  \param [in] pentries_start  Partition entries array start pointer
+ *  \param [in] pentries_end    Partition entries array end pointer
+ *  \param [in] pentry_size     Single partition entry size [bytes]
+ *
+ *  \return  0 on success
+ *
+ *  ==========================================================================
+ */
+static int gpt_pentry_index_build(struct gpt_pentry_index *index,
+                                  const uint8_t *pentries_start,
+                                  const uint8_t *pentries_end,
+                                  uint32_t pentry_size)
+{
+    uint32_t count = (pentries_end - pentries_start) / pentry_size;
+    uint32_t num_slots = 1;
+    uint8_t *buf;
+    uint32_t i;
+
+    memset(index, 0, sizeof(*index));
+    /* keep the table at most half full */
+    while (num_slots < 2 * count)
+        num_slots <<= 1;
+    buf = (uint8_t *) calloc(1, count * (MAX_GPT_NAME8_SIZE + sizeof(uint32_t)) +
+                             num_slots * sizeof(uint32_t));
+    if (!buf) {
+        fprintf(stderr, "Failed to alloc memory for GPT name index\n");
+        return -1;
+    }
+    index->next = (uint32_t *) buf;
+    index->slot = index->next + count;
+    index->name = (char (*)[MAX_GPT_NAME8_SIZE]) (index->slot + num_slots);
+    index->num_slots = num_slots;
+    index->num_entries = count;
+
+    /* Insert backwards so each chain ends up in ascending entry order */
+    for (i = count; i-- > 0;) {
+        char *name8 = index->name[i];
+        uint32_t h;
+
+        gpt_name_narrow(pentries_start + i * pentry_size +
+                        PARTITION_NAME_OFFSET, name8);
+        index->next[i] = UINT32_MAX;
+        for (h = gpt_name_hash(name8) & (num_slots - 1); index->slot[h];
+             h = (h + 1) & (num_slots - 1)) {
+            if (!strcmp(index->name[index->slot[h] - 1], name8)) {
+                index->next[i] = index->slot[h] - 1;
+                break;
+            }
+        }
+        index->slot[h] = i + 1;
+    }
+
+    return 0;
+}
+
+
+
+static void gpt_pentry_index_free(struct gpt_pentry_index *index)
+{
+    /* next is the start of the single allocation */
+    free(index->next);
+    memset(index, 0, sizeof(*index));
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Finds the first entry after a given one with exactly this name
+ *
+ *  \param [in] index  Name index of the partition entries array
+ *  \param [in] name   Partition name
+ *  \param [in] after  Entry index to search after, -1 to search all
+ *
+ *  \return  Entry index or UINT32_MAX if not found
+ *
+ *  ==========================================================================
+ */
+static uint32_t gpt_pentry_index_find(const struct gpt_pentry_index *index,
+                                      const char *name, int64_t after)
+{
+    uint32_t h;
+    uint32_t i;
+
+    if (!index->num_slots)
+        return UINT32_MAX;
+    for (h = gpt_name_hash(name) & (index->num_slots - 1); index->slot[h];
+         h = (h + 1) & (index->num_slots - 1)) {
+        if (strcmp(index->name[index->slot[h] - 1], name))
+            continue;
+        for (i = index->slot[h] - 1; i != UINT32_MAX; i = index->next[i])
+            if ((int64_t) i > after)
+                return i;
+        break;
+    }
+
+    return UINT32_MAX;
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Moves an entry of the name index to the name it now has
+ *
+ *  The entry is unlinked from the chain of its old name, whose hash slot
+ *  is freed by shifting the rest of its probe run back if the chain
+ *  empties, and linked into the chain of its new name in entry order.
+ *
+ *  \param [in,out] index  Name index of the partition entries array
+ *  \param [in] pentry     Partition entry, after its name was written
+ *  \param [in] idx        Index of the entry in the array
+ *
+ *  ==========================================================================
+ */
+static void gpt_pentry_index_rename(struct gpt_pentry_index *index,
+                                    const uint8_t *pentry, uint32_t idx)
+{
+    const uint32_t mask = index->num_slots - 1;
+    char name8[MAX_GPT_NAME8_SIZE];
+    uint32_t h, j, k;
+    uint32_t *link;
+
+    if (idx >= index->num_entries)
+        return;
+    gpt_name_narrow(pentry + PARTITION_NAME_OFFSET, name8);
+    if (!strcmp(index->name[idx], name8))
+        return;
+
+    /* Unlink from the old name's chain */
+    for (h = gpt_name_hash(index->name[idx]) & mask; index->slot[h];
+         h = (h + 1) & mask)
+        if (!strcmp(index->name[index->slot[h] - 1], index->name[idx]))
+            break;
+    if (index->slot[h] - 1 == idx && index->next[idx] == UINT32_MAX) {
+        /* Last entry of that name: backward shift deletion */
+        for (j = (h + 1) & mask; index->slot[j]; j = (j + 1) & mask) {
+            k = gpt_name_hash(index->name[index->slot[j] - 1]) & mask;
+            /* Move the slot at j back to h unless its home is in (h, j] */
+            if (h <= j ? (h < k && k <= j) : (h < k || k <= j))
+                continue;
+            index->slot[h] = index->slot[j];
+            h = j;
+        }
+        index->slot[h] = 0;
+    } else if (index->slot[h] - 1 == idx) {
+        index->slot[h] = index->next[idx] + 1;
+    } else {
+        for (j = index->slot[h] - 1; index->next[j] != idx; j = index->next[j])
+            ;
+        index->next[j] = index->next[idx];
+    }
+
+    /* Link into the new name's chain, keeping it in ascending order */
+    memcpy(index->name[idx], name8, sizeof(name8));
+    for (h = gpt_name_hash(name8) & mask; index->slot[h]; h = (h + 1) & mask)
+        if (!strcmp(index->name[index->slot[h] - 1], name8))
+            break;
+    if (!index->slot[h] || index->slot[h] - 1 > idx) {
+        index->next[idx] = index->slot[h] ? index->slot[h] - 1 : UINT32_MAX;
+        index->slot[h] = idx + 1;
+        return;
+    }
+    for (link = &index->next[index->slot[h] - 1];
+         *link != UINT32_MAX && *link < idx; link = &index->next[*link])
+        ;
+    index->next[idx] = *link;
+    *link = idx;
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Search within GPT for partition entry with the given name
+ *  or it's backup twin (name-bak).
+ *
+ *  \param [in] index     Name index of the partition entries array
+ *  \param [in] ptn_name  Partition name to seek
+ *  \param [in] after     Entry index to search after, -1 to search all
+ *
+ *  \return  First matching entry index after 'after' or UINT32_MAX
+ *
+ *  ==========================================================================
+ */
+static uint32_t gpt_pentry_index_seek(const struct gpt_pentry_index *index,
+                                      const char *ptn_name, int64_t after)
+{
+    char bak_name[MAX_GPT_NAME8_SIZE + sizeof(BAK_PTN_NAME_EXT)];
+    uint32_t i, i_bak;
+
+    i = gpt_pentry_index_find(index, ptn_name, after);
+    snprintf(bak_name, sizeof(bak_name), "%s%s", ptn_name, BAK_PTN_NAME_EXT);
+    i_bak = gpt_pentry_index_find(index, bak_name, after);
+
+    return i < i_bak ? i : i_bak;
+}
+
+
+
+/*
+ * Perfect hash of PTN_SWAP_LIST, generated at compile time: the seed is
+ * the first one for which every name in the list lands in its own slot,
+ * so classifying a partition name costs one hash and one strcmp.
+ */
+static constexpr const char *ptn_swap_names[] = { PTN_SWAP_LIST };
+#define PTN_SWAP_COUNT      ARRAY_SIZE(ptn_swap_names)
+#define PTN_SWAP_HASH_SIZE  128
+
+static_assert(PTN_SWAP_COUNT < PTN_SWAP_HASH_SIZE / 2,
+              "PTN_SWAP_HASH_SIZE too small for PTN_SWAP_LIST");
+
+static constexpr uint32_t ptn_swap_hash(uint32_t seed, const char *name)
+{
+    uint32_t h = 2166136261u ^ seed;
+
+    while (*name)
+        h = (h ^ (uint8_t) *name++) * 16777619u;
+    return (h ^ (h >> 15)) & (PTN_SWAP_HASH_SIZE - 1);
+}
+
+static constexpr bool ptn_swap_seed_ok(uint32_t seed)
+{
+    bool used[PTN_SWAP_HASH_SIZE] = {};
+
+    for (const char *name : ptn_swap_names) {
+        uint32_t h = ptn_swap_hash(seed, name);
+        if (used[h])
+            return false;
+        used[h] = true;
+    }
+    return true;
+}
+
+static constexpr uint32_t ptn_swap_find_seed()
+{
+    uint32_t seed = 0;
+
+    while (!ptn_swap_seed_ok(seed))
+        seed++;
+    return seed;
+}
+
+static constexpr uint32_t ptn_swap_seed = ptn_swap_find_seed();
+
+struct ptn_swap_table {
+    //Index in PTN_SWAP_LIST + 1 for each hash slot, 0 if unused
+    uint8_t slot[PTN_SWAP_HASH_SIZE];
+};
+
+static constexpr ptn_swap_table ptn_swap_make_table()
+{
+    ptn_swap_table t = {};
+
+    for (uint32_t i = 0; i < PTN_SWAP_COUNT; i++)
+        t.slot[ptn_swap_hash(ptn_swap_seed, ptn_swap_names[i])] = i + 1;
+    return t;
+}
+
+static constexpr ptn_swap_table ptn_swap_lookup = ptn_swap_make_table();
+
+//Returns the PTN_SWAP_LIST index of name, or -1
+static int ptn_swap_find(const char *name)
+{
+    uint32_t i = ptn_swap_lookup.slot[ptn_swap_hash(ptn_swap_seed, name)];
+
+    if (i && !strcmp(ptn_swap_names[i - 1], name))
+        return i - 1;
+    return -1;
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Swaps boot chain in GPT partition entries array
+ *
+ *  A single pass over the array classifies every entry against the whole
+ *  of PTN_SWAP_LIST: the first entry named <name> or <name>bak is the
+ *  primary and the next one its backup twin.
+ *
+ *  \param [in] pentries_start  Partition entries array start
+ *  \param [in] pentries_end    Partition entries array end
+ *  \param [in] pentry_size     Single partition entry size
+ *
+ *  \return  0 on success, 1 if no backup partitions found
+ *
+ *  ==========================================================================
+ */
+static int gpt_boot_chain_swap(const uint8_t *pentries_start,
+                                const uint8_t *pentries_end,
+                                uint32_t pentry_size)
+{
+    const uint8_t *ptn_entry[PTN_SWAP_COUNT] = {};
+    const uint8_t *ptn_bak_entry[PTN_SWAP_COUNT] = {};
+    const size_t bak_len = strlen(BAK_PTN_NAME_EXT);
+    //Skip the xbl partitions on UFS devices. That is handled
+    //seperately.
+    const int skip_xbl = gpt_utils_is_ufs_device();
+    const uint8_t *pentry;
+    int backup_not_found = 1;
+    unsigned i;
+
+    for (pentry = pentries_start; pentry + pentry_size <= pentries_end;
+         pentry += pentry_size) {
+        char name8[MAX_GPT_NAME8_SIZE];
+        size_t len;
+        int match[2];
+
+        len = gpt_name_narrow(pentry + PARTITION_NAME_OFFSET, name8);
+
+        /* An entry can match both <name> and <name'>bak */
+        match[0] = ptn_swap_find(name8);
+        match[1] = -1;
+        if (len > bak_len && !strcmp(&name8[len - bak_len], BAK_PTN_NAME_EXT)) {
+            name8[len - bak_len] = '\0';
+            match[1] = ptn_swap_find(name8);
+        }
+
+        for (int m : match) {
+            if (m < 0)
+                continue;
+            if (!ptn_entry[m])
+                ptn_entry[m] = pentry;
+            else if (!ptn_bak_entry[m])
+                ptn_bak_entry[m] = pentry;
+        }
+    }
+
+    for (i = 0; i < PTN_SWAP_COUNT; i++) {
+        uint8_t ptn_swap[PTN_ENTRY_SIZE];
+
+        if (skip_xbl && !strncmp(ptn_swap_names[i], PTN_XBL, strlen(PTN_XBL)))
+            continue;
+        if (ptn_entry[i] == NULL)
+            continue;
+        if (ptn_bak_entry[i] == NULL) {
+            fprintf(stderr, "'%s' partition not backup - skip safe update\n",
+                    ptn_swap_names[i]);
+            continue;
+        }
+
+        /* swap primary <-> backup partition entries */
+        memcpy(ptn_swap, ptn_entry[i], PTN_ENTRY_SIZE);
+        memcpy((uint8_t *) ptn_entry[i], ptn_bak_entry[i], PTN_ENTRY_SIZE);
+        memcpy((uint8_t *) ptn_bak_entry[i], ptn_swap, PTN_ENTRY_SIZE);
+        backup_not_found = 0;
+    }
+
+    return backup_not_found;
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Sets secondary GPT boot chain
+ *
+ *  The secondary entries are rebuilt from the primary ones found by
+ *  gpt_validate_disk(). They are written ahead of the header, and the
+ *  header is always written back with a valid signature. When switching
+ *  back to the normal chain the secondary header may have been invalidated
+ *  by UPDATE_BACKUP; it is then the write that makes the secondary GPT
+ *  usable again, so the entries are flushed before it. Entries that
+ *  already match the primary ones are not rewritten.
+ *
+ *  \param [in] io    stage writing to the block dev
+ *  \param [in] st    GPTs state, updated to match what was written
+ *  \param [in] boot  Boot chain to switch to
+ *
+ *  \return  0 on success
+ *
+ *  ==========================================================================
+ */
+static int gpt2_set_boot_chain(struct gpt_stage_io *io,
+                               struct gpt_disk_state *st,
+                               enum boot_chain boot)
+{
+    int64_t  gpt2_header_offset = io->gpt2_offset;
+    uint64_t pentries_start_offset;
+    uint32_t gpt_header_size;
+    uint32_t pentry_size;
+    uint32_t pentries_array_size;
+
+    uint8_t *gpt_header = io->hdr[PRIMARY_GPT];
+    uint8_t  *pentries = NULL;
+    uint32_t crc;
+    uint32_t blk_size = io->blk_size;
+    int r = -1;
+
+    if (!st->pentries_ok[PRIMARY_GPT]) {
         fprintf(stderr, "Primary GPT partition entries array CRC invalid\n");
-        r = -1;
         goto EXIT;
     }
+    pentry_size = GET_4_BYTES(gpt_header + PENTRY_SIZE_OFFSET);
+    pentries_array_size =
+        GET_4_BYTES(gpt_header + PARTITION_COUNT_OFFSET) * pentry_size;
 
-    /* Read secondary GPT header from block dev */
-    r = blk_rw(fd, 0, gpt2_header_offset, gpt_header, blk_size);
-    if (r)
-        goto EXIT;
-
+    gpt_header = io->hdr[SECONDARY_GPT];
     gpt_header_size = GET_4_BYTES(gpt_header + HEADER_SIZE_OFFSET);
     pentries_start_offset =
         GET_8_BYTES(gpt_header + PENTRIES_OFFSET) * blk_size;
 
+    pentries = io->pentries[SECONDARY_GPT];
+    if (boot == BACKUP_BOOT || st->diverged) {
+        pentries = gpt_stage_pentries(io, SECONDARY_GPT, pentries_array_size);
+        if (pentries == NULL)
+            goto EXIT;
+        memcpy(pentries, io->pentries[PRIMARY_GPT], pentries_array_size);
+        st->pentries_ok[SECONDARY_GPT] = 0;
+        st->diverged = 1;
+    }
     if (boot == BACKUP_BOOT) {
         r = gpt_boot_chain_swap(pentries, pentries + pentries_array_size,
                                 pentry_size);
@@ -359,91 +2088,153 @@ static int gpt2_set_boot_chain(int fd, enum boot_chain boot)
             goto EXIT;
     }
 
-    crc = crc32(0, pentries, pentries_array_size);
+    crc = gpt_crc32(0, pentries, pentries_array_size);
     PUT_4_BYTES(gpt_header + PARTITION_CRC_OFFSET, crc);
+    memcpy(gpt_header, GPT_SIGNATURE, sizeof(GPT_SIGNATURE));
 
     /* header CRC is calculated with this field cleared */
     PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, 0);
-    crc = crc32(0, gpt_header, gpt_header_size);
+    crc = gpt_crc32(0, gpt_header, gpt_header_size);
     PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, crc);
 
-    /* Write the modified GPT header back to block dev */
-    r = blk_rw(fd, 1, gpt2_header_offset, gpt_header, blk_size);
+    r = 0;
+    /* Write the modified GPT partititon entries array back to block dev */
+    if (!st->pentries_ok[SECONDARY_GPT]) {
+        r = gpt_stage_write(io, pentries_start_offset, pentries,
+                            pentries_array_size);
+        if (!r && boot == NORMAL_BOOT)
+            r = gpt_stage_barrier(io);
+    }
     if (!r)
-        /* Write the modified GPT partititon entries array back to block dev */
-        r = blk_rw(fd, 1, pentries_start_offset, pentries,
-                    pentries_array_size);
+        /* Write the modified GPT header back to block dev */
+        r = gpt_stage_write(io, gpt2_header_offset, gpt_header, blk_size);
+    if (!r) {
+        st->hdr[SECONDARY_GPT] = GPT_OK;
+        st->pentries_ok[SECONDARY_GPT] = 1;
+        st->diverged = boot == BACKUP_BOOT;
+    }
 
 EXIT:
-    if(gpt_header)
-            free(gpt_header);
-    if (pentries)
-            free(pentries);
     return r;
 }
 
 /**
  *  ==========================================================================
  *
- *  \brief  Checks GPT state (header signature and CRC)
+ *  \brief  Checks GPT header state (signature and CRC)
  *
- *  \param [in] fd      block dev file descriptor
- *  \param [in] gpt     GPT header to be checked
- *  \param [out] state  GPT header state
+ *  \param [in] hdr       GPT header block, left unchanged
+ *  \param [in] blk_size  Block size [bytes]
  *
- *  \return  0 on success
+ *  \return  GPT header state
  *
  *  ==========================================================================
  */
-static int gpt_get_state(int fd, enum gpt_instance gpt, enum gpt_state *state)
+static enum gpt_state gpt_hdr_state(uint8_t *hdr, uint32_t blk_size)
 {
-    int64_t gpt_header_offset;
-    uint32_t gpt_header_size;
-    uint8_t  *gpt_header = NULL;
-    uint32_t crc;
-    uint32_t blk_size = 0;
+    uint32_t gpt_header_size = GET_4_BYTES(hdr + HEADER_SIZE_OFFSET);
+    uint32_t crc = GET_4_BYTES(hdr + HEADER_CRC_OFFSET);
+    enum gpt_state state = GPT_OK;
 
-    *state = GPT_OK;
+    if (gpt_header_size < PARTITION_CRC_OFFSET + 4 ||
+        gpt_header_size > blk_size)
+        return GPT_BAD_CRC;
+    if (memcmp(hdr, GPT_SIGNATURE, sizeof(GPT_SIGNATURE)))
+        state = GPT_BAD_SIGNATURE;
 
-    if (ioctl(fd, BLKSSZGET, &blk_size) != 0) {
-            fprintf(stderr, "Failed to get GPT device block size: %s\n",
-                            strerror(errno));
-            goto error;
-    }
-    gpt_header = (uint8_t*)malloc(blk_size);
-    if (!gpt_header) {
-            fprintf(stderr, "gpt_get_state:Failed to alloc memory for header\n");
-            goto error;
-    }
-    if (gpt == PRIMARY_GPT)
-        gpt_header_offset = blk_size;
-    else {
-        gpt_header_offset = lseek64(fd, 0, SEEK_END) - blk_size;
-        if (gpt_header_offset < 0) {
-            fprintf(stderr, "gpt_get_state:Seek to end of GPT part fail\n");
-            goto error;
-        }
-    }
+    /* header CRC is calculated with this field cleared */
+    PUT_4_BYTES(hdr + HEADER_CRC_OFFSET, 0);
+    if (gpt_crc32(0, hdr, gpt_header_size) != crc)
+        state = GPT_BAD_CRC;
+    PUT_4_BYTES(hdr + HEADER_CRC_OFFSET, crc);
+    return state;
+}
+
+
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Reads and checks both GPTs of the stage's block dev
+ *
+ *  Both headers and both partition entry arrays are read into the stage
+ *  buffers and all four CRCs are checked. On a standard layout this is one
+ *  read per GPT: the primary header with the entries following it, and
+ *  the backup entries with the secondary header in the last block.
+ *  The entries of a GPT whose header CRC is invalid are not read.
+ *
+ *  \param [in] io   stage
+ *  \param [out] st  GPTs state
+ *
+ *  \return  0 on success
+ *
+ *  ==========================================================================
+ */
+static int gpt_validate_disk(struct gpt_stage_io *io,
+                             struct gpt_disk_state *st)
+{
+    uint32_t blk_size = io->blk_size;
+    uint32_t std_size =
+        DIV_ROUND_UP(GPT_STD_PENTRY_ARR_SIZE, blk_size) * blk_size;
+    int64_t std_offset[2];
+    uint64_t size[2] = { 0, 0 };
+    struct iovec iov[2];
+    int gpt;
 
-    if (blk_rw(fd, 0, gpt_header_offset, gpt_header, blk_size)) {
-        fprintf(stderr, "gpt_get_state: blk_rw failed\n");
-        goto error;
+    std_offset[PRIMARY_GPT] = (int64_t) GPT_STD_PENTRIES_LBA * blk_size;
+    std_offset[SECONDARY_GPT] = io->gpt2_offset - std_size;
+    if (std_offset[SECONDARY_GPT] <= std_offset[PRIMARY_GPT]) {
+        fprintf(stderr, "Device too small for its GPT\n");
+        return -1;
     }
-    if (memcmp(gpt_header, GPT_SIGNATURE, sizeof(GPT_SIGNATURE)))
-        *state = GPT_BAD_SIGNATURE;
-    gpt_header_size = GET_4_BYTES(gpt_header + HEADER_SIZE_OFFSET);
+    if (!gpt_stage_pentries(io, PRIMARY_GPT, std_size) ||
+        !gpt_stage_pentries(io, SECONDARY_GPT, std_size))
+        return -1;
 
-    crc = GET_4_BYTES(gpt_header + HEADER_CRC_OFFSET);
-    /* header CRC is calculated with this field cleared */
-    PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, 0);
-    if (crc32(0, gpt_header, gpt_header_size) != crc)
-        *state = GPT_BAD_CRC;
-    free(gpt_header);
+    /* Primary header and, speculatively, the entries right after it */
+    iov[0].iov_base = io->hdr[PRIMARY_GPT];
+    iov[0].iov_len = blk_size;
+    iov[1].iov_base = io->pentries[PRIMARY_GPT];
+    iov[1].iov_len = std_size;
+    if (blk_readv(io->fd, blk_size, iov, 2))
+        return -1;
+    /* Backup entries ending right before the secondary header */
+    iov[0].iov_base = io->pentries[SECONDARY_GPT];
+    iov[0].iov_len = std_size;
+    iov[1].iov_base = io->hdr[SECONDARY_GPT];
+    iov[1].iov_len = blk_size;
+    if (blk_readv(io->fd, std_offset[SECONDARY_GPT], iov, 2))
+        return -1;
+
+    for (gpt = PRIMARY_GPT; gpt <= SECONDARY_GPT; gpt++) {
+        uint8_t *hdr = io->hdr[gpt];
+        uint64_t offset;
+
+        st->hdr[gpt] = gpt_hdr_state(hdr, blk_size);
+        st->pentries_ok[gpt] = 0;
+        if (st->hdr[gpt] == GPT_BAD_CRC)
+            continue;
+        offset = GET_8_BYTES(hdr + PENTRIES_OFFSET) * blk_size;
+        size[gpt] = (uint64_t) GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) *
+            GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
+        if (!size[gpt] || size[gpt] > (uint64_t) io->gpt2_offset)
+            continue;
+        /* Other layouts cost one more read */
+        if ((int64_t) offset != std_offset[gpt] || size[gpt] > std_size) {
+            if (!gpt_stage_pentries(io, (enum gpt_instance) gpt, size[gpt]) ||
+                blk_rw(io->fd, 0, offset, io->pentries[gpt], size[gpt]))
+                return -1;
+        }
+        st->pentries_ok[gpt] =
+            gpt_crc32(0, io->pentries[gpt], size[gpt]) ==
+            GET_4_BYTES(hdr + PARTITION_CRC_OFFSET);
+    }
+    st->diverged = !st->pentries_ok[PRIMARY_GPT] ||
+        !st->pentries_ok[SECONDARY_GPT] ||
+        size[PRIMARY_GPT] != size[SECONDARY_GPT] ||
+        memcmp(io->pentries[PRIMARY_GPT], io->pentries[SECONDARY_GPT],
+               size[PRIMARY_GPT]);
     return 0;
-error:
-    if (gpt_header)
-            free(gpt_header);
-    return -1;
 }
 
 
@@ -453,7 +2244,9 @@ error:
  *
  *  \brief  Sets GPT header state (used to corrupt and fix GPT signature)
  *
- *  \param [in] fd     block dev file descriptor
+ *  Works on the header found by gpt_validate_disk().
+ *
+ *  \param [in] io     stage writing to the block dev
  *  \param [in] gpt    GPT header to be checked
  *  \param [in] state  GPT header state to set (GPT_OK or GPT_BAD_SIGNATURE)
  *
@@ -461,70 +2254,49 @@ error:
  *
  *  ==========================================================================
  */
-static int gpt_set_state(int fd, enum gpt_instance gpt, enum gpt_state state)
+static int gpt_set_state(struct gpt_stage_io *io, enum gpt_instance gpt,
+                         enum gpt_state state)
 {
     int64_t gpt_header_offset;
     uint32_t gpt_header_size;
-    uint8_t  *gpt_header = NULL;
+    uint8_t  *gpt_header = io->hdr[gpt];
     uint32_t crc;
-    uint32_t blk_size = 0;
+    uint32_t blk_size = io->blk_size;
 
-    if (ioctl(fd, BLKSSZGET, &blk_size) != 0) {
-            fprintf(stderr, "Failed to get GPT device block size: %s\n",
-                            strerror(errno));
-            goto error;
-    }
-    gpt_header = (uint8_t*)malloc(blk_size);
-    if (!gpt_header) {
-            fprintf(stderr, "Failed to alloc memory for gpt header\n");
-            goto error;
-    }
     if (gpt == PRIMARY_GPT)
         gpt_header_offset = blk_size;
-    else {
-        gpt_header_offset = lseek64(fd, 0, SEEK_END) - blk_size;
-        if (gpt_header_offset < 0) {
-            fprintf(stderr, "Failed to seek to end of GPT device\n");
-            goto error;
-        }
-    }
-    if (blk_rw(fd, 0, gpt_header_offset, gpt_header, blk_size)) {
-        fprintf(stderr, "Failed to r/w gpt header\n");
-        goto error;
-    }
+    else
+        gpt_header_offset = io->gpt2_offset;
     if (state == GPT_OK)
         memcpy(gpt_header, GPT_SIGNATURE, sizeof(GPT_SIGNATURE));
     else if (state == GPT_BAD_SIGNATURE)
         *gpt_header = 0;
     else {
         fprintf(stderr, "gpt_set_state: Invalid state\n");
-        goto error;
+        return -1;
     }
 
     gpt_header_size = GET_4_BYTES(gpt_header + HEADER_SIZE_OFFSET);
 
     /* header CRC is calculated with this field cleared */
     PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, 0);
-    crc = crc32(0, gpt_header, gpt_header_size);
+    crc = gpt_crc32(0, gpt_header, gpt_header_size);
     PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, crc);
 
-    if (blk_rw(fd, 1, gpt_header_offset, gpt_header, blk_size)) {
+    if (gpt_stage_write(io, gpt_header_offset, gpt_header, blk_size)) {
         fprintf(stderr, "gpt_set_state: blk write failed\n");
-        goto error;
+        return -1;
     }
     return 0;
-error:
-    if(gpt_header)
-           free(gpt_header);
-    return -1;
 }
 
-int get_scsi_node_from_bootdevice(const char *bootdev_path,
+static int gpt_find_scsi_node(const char *bootdev_path,
                 char *sg_node_path,
                 size_t buf_size)
 {
         char sg_dir_path[PATH_MAX] = {0};
         char real_path[PATH_MAX] = {0};
+        const char *lun_name;
         DIR *scsi_dir = NULL;
         struct dirent *de;
         int node_found = 0;
@@ -533,31 +2305,29 @@ int get_scsi_node_from_bootdevice(const char *bootdev_path,
                                  __func__);
                 goto error;
         }
-        if (readlink(bootdev_path, real_path, sizeof(real_path) - 1) < 0) {
+        if (gpt_readlinkat(AT_FDCWD, bootdev_path, real_path, sizeof(real_path) - 1) < 0) {
                         fprintf(stderr, "failed to resolve link for %s(%s)\n",
                                         bootdev_path,
                                         strerror(errno));
                         goto error;
         }
-        if(strlen(real_path) < PATH_TRUNCATE_LOC + 1){
-            fprintf(stderr, "Unrecognized path :%s:\n",
-                           real_path);
-            goto error;
-        }
         //For the safe side in case there are additional partitions on
-        //the XBL lun we truncate the name.
-        real_path[PATH_TRUNCATE_LOC] = '\0';
-        if(strlen(real_path) < LUN_NAME_START_LOC + 1){
-            fprintf(stderr, "Unrecognized truncated path :%s:\n",
+        //the XBL lun we go from the partition to its disk.
+        if (gpt_link_to_disk(real_path, sizeof(real_path))) {
+            fprintf(stderr, "Unrecognized path :%s:\n",
                            real_path);
             goto error;
         }
-        //This will give us /dev/block/sdb/device/scsi_generic
+        //From /dev/block/sda get just sda
+        lun_name = strrchr(real_path, '/');
+        lun_name = lun_name ? lun_name + 1 : real_path;
+        //This will give us /sys/block/sdb/device/scsi_generic
         //which contains a file sgY whose name gives us the path
         //to /dev/sgY which we return
         snprintf(sg_dir_path, sizeof(sg_dir_path) - 1,
-                        "/sys/block/%s/device/scsi_generic",
-                        &real_path[LUN_NAME_START_LOC]);
+                        "%s/%s/device/scsi_generic",
+                        backend.sysfs_block_dir,
+                        lun_name);
         scsi_dir = opendir(sg_dir_path);
         if (!scsi_dir) {
                 fprintf(stderr, "%s : Failed to open %s(%s)\n",
@@ -572,7 +2342,8 @@ int get_scsi_node_from_bootdevice(const char *bootdev_path,
                 else if (!strncmp(de->d_name, "sg", 2)) {
                           snprintf(sg_node_path,
                                         buf_size -1,
-                                        "/dev/%s",
+                                        "%s/%s",
+                                        backend.sg_dev_dir,
                                         de->d_name);
                           fprintf(stderr, "%s:scsi generic node is :%s:\n",
                                           __func__,
@@ -594,24 +2365,75 @@ error:
         return -1;
 }
 
-int set_boot_lun(char *sg_dev, uint8_t boot_lun_id)
+int get_scsi_node_from_bootdevice(const char *bootdev_path,
+                char *sg_node_path,
+                size_t buf_size)
 {
-        int fd = -1;
-        int rc;
-        struct ufs_ioctl_query_data *data = NULL;
-        size_t ioctl_data_size = sizeof(struct ufs_ioctl_query_data) + UFS_ATTR_DATA_SIZE;
+        map<string, string>::iterator it;
+        int found = 0;
+        if (!bootdev_path || !sg_node_path) {
+                fprintf(stderr, "%s : invalid argument\n",
+                                 __func__);
+                return -1;
+        }
+        pthread_mutex_lock(&topo_lock);
+        if (topo_changed_locked())
+                topo_drop_locked();
+        it = topo_sg_nodes.find(bootdev_path);
+        if (it != topo_sg_nodes.end()) {
+                strlcpy(sg_node_path, it->second.c_str(), buf_size);
+                found = 1;
+        }
+        pthread_mutex_unlock(&topo_lock);
+        if (found)
+                return 0;
+        if (gpt_find_scsi_node(bootdev_path, sg_node_path, buf_size))
+                return -1;
+        pthread_mutex_lock(&topo_lock);
+        if (!topo_watch_locked() && !topo_changed_locked())
+                topo_sg_nodes[bootdev_path] = sg_node_path;
+        pthread_mutex_unlock(&topo_lock);
+        return 0;
+}
 
-        data = (struct ufs_ioctl_query_data*)malloc(ioctl_data_size);
-        if (!data) {
-                fprintf(stderr, "%s: Failed to alloc query data struct\n",
-                                __func__);
-                goto error;
+//Read (UPIU_QUERY_OPCODE_READ_ATTR) or write (UPIU_QUERY_OPCODE_WRITE_ATTR)
+//the UFS device attribute idn through the opened scsi generic node fd. A
+//regular file stands in for the device in image backends: byte idn of it
+//holds attribute idn.
+static int ufs_query_attr(int fd, uint32_t opcode, uint8_t idn, uint8_t *val)
+{
+        uint64_t raw[DIV_ROUND_UP(sizeof(struct ufs_ioctl_query_data) +
+                        UFS_ATTR_DATA_SIZE, sizeof(uint64_t))];
+        struct ufs_ioctl_query_data *data = (struct ufs_ioctl_query_data*)raw;
+        struct stat st;
+        uint64_t start;
+        int rc;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode)) {
+                if (opcode == UPIU_QUERY_OPCODE_READ_ATTR)
+                        return blk_rw(fd, 0, idn, val, 1);
+                return blk_rw(fd, 1, idn, val, 1);
         }
-        memset(data, 0, ioctl_data_size);
-        data->opcode = UPIU_QUERY_OPCODE_WRITE_ATTR;
-        data->idn = QUERY_ATTR_IDN_BOOT_LU_EN;
+        memset(raw, 0, sizeof(raw));
+        data->opcode = opcode;
+        data->idn = idn;
         data->buf_size = UFS_ATTR_DATA_SIZE;
-        data->buffer[0] = boot_lun_id;
+        if (opcode != UPIU_QUERY_OPCODE_READ_ATTR)
+                data->buffer[0] = *val;
+        start = gpt_stat_start();
+        rc = ioctl(fd, UFS_IOCTL_QUERY, data);
+        gpt_stat_add(GPT_STAT_IOCTL, start, 0);
+        if (rc)
+                return -1;
+        if (opcode == UPIU_QUERY_OPCODE_READ_ATTR)
+                *val = data->buffer[0];
+        return 0;
+}
+
+int set_boot_lun(char *sg_dev, uint8_t boot_lun_id)
+{
+        int fd = -1;
+        uint8_t cur_lun_id = 0;
+
         fd = open(sg_dev, O_RDWR);
         if (fd < 0) {
                 fprintf(stderr, "%s: Failed to open %s(%s)\n",
@@ -620,24 +2442,31 @@ int set_boot_lun(char *sg_dev, uint8_t boot_lun_id)
                                 strerror(errno));
                 goto error;
         }
-        rc = ioctl(fd, UFS_IOCTL_QUERY, data);
-        if (rc) {
+        //Stage transitions often ask for the boot LUN already in use
+        if (!ufs_query_attr(fd, UPIU_QUERY_OPCODE_READ_ATTR,
+                                QUERY_ATTR_IDN_BOOT_LU_EN, &cur_lun_id) &&
+                        cur_lun_id == boot_lun_id) {
+                close(fd);
+                return 0;
+        }
+        if (ufs_query_attr(fd, UPIU_QUERY_OPCODE_WRITE_ATTR,
+                                QUERY_ATTR_IDN_BOOT_LU_EN, &boot_lun_id)) {
                 fprintf(stderr, "%s: UFS query ioctl failed(%s)\n",
                                 __func__,
                                 strerror(errno));
                 goto error;
         }
         close(fd);
-        free(data);
         return 0;
 error:
         if (fd >= 0)
                 close(fd);
-        if (data)
-                free(data);
         return -1;
 }
 
+//Serializes boot LUN switches issued by concurrently prepared LUNs
+static pthread_mutex_t boot_lun_lock = PTHREAD_MUTEX_INITIALIZER;
+
 //Swtich betwieen using either the primary or the backup
 //boot LUN for boot. This is required since UFS boot partitions
 //cannot have a backup GPT which is what we use for failsafe
@@ -657,17 +2486,18 @@ error:
 //the boot lun to either LUNA or LUNB
 int gpt_utils_set_xbl_boot_partition(enum boot_chain chain)
 {
-        struct stat st;
         ///sys/block/sdX/device/scsi_generic/
         char sg_dev_node[PATH_MAX] = {0};
+        char boot_dev_path[PATH_MAX] = {0};
         uint8_t boot_lun_id = 0;
         const char *boot_dev = NULL;
+        int rc;
 
         if (chain == BACKUP_BOOT) {
                 boot_lun_id = BOOT_LUN_B_ID;
-                if (!stat(XBL_BACKUP, &st))
+                if (gpt_by_name_exists(XBL_BACKUP))
                         boot_dev = XBL_BACKUP;
-                else if (!stat(XBL_AB_SECONDARY, &st))
+                else if (gpt_by_name_exists(XBL_AB_SECONDARY))
                         boot_dev = XBL_AB_SECONDARY;
                 else {
                         fprintf(stderr, "%s: Failed to locate secondary xbl\n",
@@ -676,9 +2506,9 @@ int gpt_utils_set_xbl_boot_partition(enum boot_chain chain)
                 }
         } else if (chain == NORMAL_BOOT) {
                 boot_lun_id = BOOT_LUN_A_ID;
-                if (!stat(XBL_PRIMARY, &st))
+                if (gpt_by_name_exists(XBL_PRIMARY))
                         boot_dev = XBL_PRIMARY;
-                else if (!stat(XBL_AB_PRIMARY, &st))
+                else if (gpt_by_name_exists(XBL_AB_PRIMARY))
                         boot_dev = XBL_AB_PRIMARY;
                 else {
                         fprintf(stderr, "%s: Failed to locate primary xbl\n",
@@ -691,26 +2521,31 @@ int gpt_utils_set_xbl_boot_partition(enum boot_chain chain)
         }
         //We need either both xbl and xblbak or both xbl_a and xbl_b to exist at
         //the same time. If not the current configuration is invalid.
-        if((stat(XBL_PRIMARY, &st) ||
-                                stat(XBL_BACKUP, &st)) &&
-                        (stat(XBL_AB_PRIMARY, &st) ||
-                         stat(XBL_AB_SECONDARY, &st))) {
-                fprintf(stderr, "%s:primary/secondary XBL prt not found(%s)\n",
-                                __func__,
-                                strerror(errno));
+        if((!gpt_by_name_exists(XBL_PRIMARY) ||
+                                !gpt_by_name_exists(XBL_BACKUP)) &&
+                        (!gpt_by_name_exists(XBL_AB_PRIMARY) ||
+                         !gpt_by_name_exists(XBL_AB_SECONDARY))) {
+                fprintf(stderr, "%s:primary/secondary XBL prt not found\n",
+                                __func__);
                 goto error;
         }
+        gpt_by_name_path(boot_dev, boot_dev_path, sizeof(boot_dev_path));
         fprintf(stderr, "%s: setting %s lun as boot lun\n",
                         __func__,
-                        boot_dev);
-        if (get_scsi_node_from_bootdevice(boot_dev,
+                        boot_dev_path);
+        if (get_scsi_node_from_bootdevice(boot_dev_path,
                                 sg_dev_node,
                                 sizeof(sg_dev_node))) {
                 fprintf(stderr, "%s: Failed to get scsi node path for xblbak\n",
                                 __func__);
                 goto error;
         }
-        if (set_boot_lun(sg_dev_node, boot_lun_id)) {
+        //LUNs are prepared in parallel and each may switch the boot LUN;
+        //keep the UFS queries from interleaving.
+        pthread_mutex_lock(&boot_lun_lock);
+        rc = set_boot_lun(sg_dev_node, boot_lun_id);
+        pthread_mutex_unlock(&boot_lun_lock);
+        if (rc) {
                 fprintf(stderr, "%s: Failed to set xblbak as boot partition\n",
                                 __func__);
                 goto error;
@@ -723,12 +2558,21 @@ error:
 int gpt_utils_is_ufs_device()
 {
     char bootdevice[PROPERTY_VALUE_MAX] = {0};
+    int is_ufs;
+    if (backend.is_ufs >= 0)
+        return backend.is_ufs;
+    is_ufs = topo_is_ufs;
+    if (is_ufs >= 0)
+        return is_ufs;
     property_get("ro.boot.bootdevice", bootdevice, "N/A");
     if (strlen(bootdevice) < strlen(".ufshc") + 1)
-        return 0;
-    return (!strncmp(&bootdevice[strlen(bootdevice) - strlen(".ufshc")],
-                            ".ufshc",
-                            sizeof(".ufshc")));
+        is_ufs = 0;
+    else
+        is_ufs = !strncmp(&bootdevice[strlen(bootdevice) - strlen(".ufshc")],
+                          ".ufshc",
+                          sizeof(".ufshc"));
+    topo_is_ufs = is_ufs;
+    return is_ufs;
 }
 //dev_path is the path to the block device that contains the GPT image that
 //needs to be updated. This would be the device which holds one or more critical
@@ -737,15 +2581,26 @@ int gpt_utils_is_ufs_device()
 //containing all the partitions For UFS devices it could potentially be
 //invoked multiple times, once for each LUN containing critical image(s) and
 //their backups
+//Each stage has a single commit point: the header write that changes which
+//GPT the bootloader picks. Everything that write depends on is flushed
+//ahead of it, and it is flushed itself before returning so that the caller
+//may start writing partitions.
 int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
 {
+    uint64_t start = gpt_stat_start();
     int r = 0;
     int fd = -1;
+    int lock_fd = -1;
+    struct gpt_stage_io io = {};
     int is_ufs = gpt_utils_is_ufs_device();
+    int has_xbl;
+    struct gpt_disk_state st;
     enum gpt_state gpt_prim, gpt_second;
     enum boot_update_stage internal_stage;
-    struct stat xbl_partition_stat;
 
+    ATRACE_BEGIN(stage == UPDATE_MAIN ? "gpt-utils: prepare main" :
+                 stage == UPDATE_BACKUP ? "gpt-utils: prepare backup" :
+                 "gpt-utils: prepare finalize");
     if (!dev_path) {
         fprintf(stderr, "%s: Invalid dev_path\n",
                         __func__);
@@ -756,18 +2611,20 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
     if (fd < 0) {
         fprintf(stderr, "%s: Opening '%s' failed: %s\n",
                         __func__,
-                       BLK_DEV_FILE,
+                       dev_path,
                        strerror(errno));
         r = -1;
         goto EXIT;
     }
-    r = gpt_get_state(fd, PRIMARY_GPT, &gpt_prim) ||
-        gpt_get_state(fd, SECONDARY_GPT, &gpt_second);
+    r = gpt_stage_init(&io, fd, dev_path) ||
+        gpt_validate_disk(&io, &st);
     if (r) {
         fprintf(stderr, "%s: Getting GPT headers state failed\n",
                         __func__);
         goto EXIT;
     }
+    gpt_prim = st.hdr[PRIMARY_GPT];
+    gpt_second = st.hdr[SECONDARY_GPT];
 
     /* These 2 combinations are unexpected and unacceptable */
     if (gpt_prim == GPT_BAD_CRC || gpt_second == GPT_BAD_CRC) {
@@ -806,17 +2663,22 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         goto EXIT;
     }
 
+    /* Look the links up before taking the lock, see gpt_snapshot_lock() */
+    has_xbl = is_ufs && gpt_by_name_exists(XBL_PRIMARY) &&
+        gpt_by_name_exists(XBL_BACKUP);
+    /* Other processes must not pick up the tables being changed */
+    lock_fd = gpt_snapshot_lock(LOCK_SH);
+    gpt_snapshot_invalidate();
+
     switch (stage) {
     case UPDATE_MAIN:
             if (is_ufs) {
-                if(stat(XBL_PRIMARY, &xbl_partition_stat)||
-                                stat(XBL_BACKUP, &xbl_partition_stat)){
+                if (!has_xbl) {
                         //Non fatal error. Just means this target does not
                         //use XBL but relies on sbl whose update is handled
                         //by the normal methods.
-                        fprintf(stderr, "%s: xbl part not found(%s).Assuming sbl in use\n",
-                                        __func__,
-                                        strerror(errno));
+                        fprintf(stderr, "%s: xbl part not found.Assuming sbl in use\n",
+                                        __func__);
                 } else {
                         //Switch the boot lun so that backup boot LUN is used
                         r = gpt_utils_set_xbl_boot_partition(BACKUP_BOOT);
@@ -831,7 +2693,7 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         //the backup copy of the boot critical images
         fprintf(stderr, "%s: Preparing for primary partition update\n",
                         __func__);
-        r = gpt2_set_boot_chain(fd, BACKUP_BOOT);
+        r = gpt2_set_boot_chain(&io, &st, BACKUP_BOOT);
         if (r) {
             if (r < 0)
                 fprintf(stderr,
@@ -843,8 +2705,10 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
             goto EXIT;
         }
         //corrupt the primary GPT so that the backup(which now points to
-        //the backup boot partitions is used)
-        r = gpt_set_state(fd, PRIMARY_GPT, GPT_BAD_SIGNATURE);
+        //the backup boot partitions is used). The backup has to be
+        //complete on disk before it becomes the only valid GPT.
+        r = gpt_stage_barrier(&io) ||
+            gpt_set_state(&io, PRIMARY_GPT, GPT_BAD_SIGNATURE);
         if (r) {
             fprintf(stderr, "%s: Corrupting primary GPT header failed\n",
                             __func__);
@@ -853,14 +2717,12 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         break;
     case UPDATE_BACKUP:
         if (is_ufs) {
-                if(stat(XBL_PRIMARY, &xbl_partition_stat)||
-                                stat(XBL_BACKUP, &xbl_partition_stat)){
+                if (!has_xbl) {
                         //Non fatal error. Just means this target does not
                         //use XBL but relies on sbl whose update is handled
                         //by the normal methods.
-                        fprintf(stderr, "%s: xbl part not found(%s).Assuming sbl in use\n",
-                                        __func__,
-                                        strerror(errno));
+                        fprintf(stderr, "%s: xbl part not found.Assuming sbl in use\n",
+                                        __func__);
                 } else {
                         //Switch the boot lun so that backup boot LUN is used
                         r = gpt_utils_set_xbl_boot_partition(NORMAL_BOOT);
@@ -874,14 +2736,15 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         //Fix the primary GPT header so that is used
         fprintf(stderr, "%s: Preparing for backup partition update\n",
                         __func__);
-        r = gpt_set_state(fd, PRIMARY_GPT, GPT_OK);
+        r = gpt_set_state(&io, PRIMARY_GPT, GPT_OK) ||
+            gpt_stage_barrier(&io);
         if (r) {
             fprintf(stderr, "%s: Fixing primary GPT header failed\n",
                              __func__);
             goto EXIT;
         }
         //Corrupt the scondary GPT header
-        r = gpt_set_state(fd, SECONDARY_GPT, GPT_BAD_SIGNATURE);
+        r = gpt_set_state(&io, SECONDARY_GPT, GPT_BAD_SIGNATURE);
         if (r) {
             fprintf(stderr, "%s: Corrupting secondary GPT header failed\n",
                             __func__);
@@ -891,31 +2754,29 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
     case UPDATE_FINALIZE:
         //Undo the changes we had made in the UPDATE_MAIN stage so that the
         //primary/backup GPT headers once again point to the same set of
-        //partitions
+        //partitions. This also fixes the secondary GPT header.
         fprintf(stderr, "%s: Finalizing partitions\n",
                         __func__);
-        r = gpt2_set_boot_chain(fd, NORMAL_BOOT);
+        r = gpt2_set_boot_chain(&io, &st, NORMAL_BOOT);
         if (r < 0) {
             fprintf(stderr, "%s: Setting secondary GPT to normal boot failed\n",
                             __func__);
             goto EXIT;
         }
-
-        r = gpt_set_state(fd, SECONDARY_GPT, GPT_OK);
-        if (r) {
-            fprintf(stderr, "%s: Fixing secondary GPT header failed\n",
-                            __func__);
-            goto EXIT;
-        }
         break;
     default:;
     }
 
 EXIT:
     if (fd >= 0) {
-       fsync(fd);
+       if (gpt_stage_barrier(&io) && !r)
+           r = -1;
+       gpt_stage_release(&io);
        close(fd);
     }
+    gpt_snapshot_unlock(lock_fd);
+    gpt_stat_add(GPT_STAT_PREPARE, start, 0);
+    ATRACE_END();
     return r;
 }
 
@@ -965,12 +2826,52 @@ int add_lun_to_update_list(char *lun_path, struct update_data *dat)
         return 0;
 }
 
+static void *prepare_lun_worker(void *arg)
+{
+        struct lun_update_job *job = (struct lun_update_job *)arg;
+        uint32_t i;
+
+        while ((i = job->next.fetch_add(1)) < job->data->num_valid_entries)
+                job->rcodes[i] = prepare_partitions(job->stage,
+                                job->data->lun_list[i]);
+        return NULL;
+}
+
+//Run prepare_partitions() for every LUN in data on a small pool of
+//threads, storing the result for lun_list[i] in rcodes[i]. The calling
+//thread takes part, so if no thread can be started it simply does all
+//the work itself.
+static void prepare_luns(enum boot_update_stage stage,
+                struct update_data *data,
+                int *rcodes)
+{
+        struct lun_update_job job;
+        pthread_t workers[MAX_UPDATE_WORKERS - 1];
+        uint32_t num_workers = 0;
+        uint32_t i;
+
+        job.stage = stage;
+        job.data = data;
+        job.rcodes = rcodes;
+        job.next = 0;
+        for (i = 0; i + 1 < data->num_valid_entries &&
+                        i < MAX_UPDATE_WORKERS - 1; i++) {
+                if (pthread_create(&workers[num_workers], NULL,
+                                        prepare_lun_worker, &job))
+                        break;
+                num_workers++;
+        }
+        prepare_lun_worker(&job);
+        for (i = 0; i < num_workers; i++)
+                pthread_join(workers[i], NULL);
+}
+
 int prepare_boot_update(enum boot_update_stage stage)
 {
         int is_ufs = gpt_utils_is_ufs_device();
         struct stat ufs_dir_stat;
         struct update_data data;
-        int rcode = 0;
+        int rcodes[MAX_LUNS] = {0};
         uint32_t i = 0;
         int is_error = 0;
         const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
@@ -981,7 +2882,7 @@ int prepare_boot_update(enum boot_update_stage stage)
 
         if (!is_ufs) {
                 //emmc device. Just pass in path to mmcblk0
-                return prepare_partitions(stage, BLK_DEV_FILE);
+                return prepare_partitions(stage, backend.emmc_disk);
         } else {
                 //Now we need to find the list of LUNs over
                 //which the boot critical images are spread
@@ -1004,22 +2905,22 @@ int prepare_boot_update(enum boot_update_stage stage)
                                 continue;
                         snprintf(buf, sizeof(buf),
                                         "%s/%sbak",
-                                        BOOT_DEV_DIR,
+                                        backend.by_name_dir,
                                         ptn_swap_list[i]);
                         if (stat(buf, &ufs_dir_stat)) {
                                 continue;
                         }
-                        if (readlink(buf, real_path, sizeof(real_path) - 1) < 0)
+                        if (gpt_readlinkat(AT_FDCWD, buf, real_path,
+                                                sizeof(real_path) - 1) < 0)
                         {
                                 fprintf(stderr, "%s: readlink error. Skipping %s",
                                                 __func__,
                                                 strerror(errno));
                         } else {
-                              if(strlen(real_path) < PATH_TRUNCATE_LOC + 1){
+                              if(gpt_link_to_disk(real_path, sizeof(real_path))){
                                     fprintf(stderr, "Unknown path.Skipping :%s:\n",
                                                 real_path);
                                 } else {
-                                    real_path[PATH_TRUNCATE_LOC] = '\0';
                                     add_lun_to_update_list(real_path, &data);
                                 }
                         }
@@ -1031,8 +2932,12 @@ int prepare_boot_update(enum boot_update_stage stage)
                                         __func__,
                                         data.lun_list[i],
                                         stage);
-                        rcode = prepare_partitions(stage, data.lun_list[i]);
-                        if (rcode != 0)
+                }
+                //The LUNs are independent, so prepare them concurrently
+                //and report the results in list order afterwards
+                prepare_luns(stage, &data, rcodes);
+                for (i=0; i < data.num_valid_entries; i++) {
+                        if (rcodes[i] != 0)
                         {
                                 fprintf(stderr, "%s: Failed to prepare %s.Continuing..\n",
                                                 __func__,
@@ -1057,27 +2962,37 @@ static int get_dev_path_from_partition_name(const char *partname,
 {
         struct stat st;
         char path[PATH_MAX] = {0};
+        ssize_t len;
+        shared_ptr<const gpt_disk_map> disks;
+        gpt_disk_map::const_iterator disk;
         if (!partname || !buf || buflen < ((PATH_TRUNCATE_LOC) + 1)) {
                 ALOGE("%s: Invalid argument", __func__);
                 goto error;
         }
         if (gpt_utils_is_ufs_device()) {
+                disks = topo_get_disks();
+                if (disks) {
+                        disk = disks->find(partname);
+                        if (disk == disks->end())
+                                goto error;
+                        strlcpy(buf, disk->second.c_str(), buflen);
+                        return 0;
+                }
                 //Need to find the lun that holds partition partname
-                snprintf(path, sizeof(path),
-                                "%s/%s",
-                                BOOT_DEV_DIR,
-                                partname);
+                gpt_by_name_path(partname, path, sizeof(path));
                 if (stat(path, &st)) {
                         goto error;
                 }
-                if (readlink(path, buf, buflen) < 0)
+                len = gpt_readlinkat(AT_FDCWD, path, buf, buflen - 1);
+                if (len < 0)
                 {
                         goto error;
-                } else {
-                        buf[PATH_TRUNCATE_LOC] = '\0';
                 }
+                buf[len] = '\0';
+                if (gpt_link_to_disk(buf, buflen))
+                        goto error;
         } else {
-                snprintf(buf, buflen, BLK_DEV_FILE);
+                strlcpy(buf, backend.emmc_disk, buflen);
         }
         return 0;
 
@@ -1085,89 +3000,120 @@ error:
         return -1;
 }
 
-int gpt_utils_get_partition_map(vector<string>& ptn_list,
-                map<string, vector<string>>& partition_map) {
-        char devpath[PATH_MAX] = {'\0'};
-        map<string, vector<string>>::iterator it;
-        if (ptn_list.size() < 1) {
+namespace gpt {
+
+optional<PartitionMap> PartitionMap::Build(span<const string_view> partitions)
+{
+        PartitionMap pm;
+        shared_ptr<const gpt_disk_map> disks;
+        shared_ptr<gpt_disk_map> own;
+        char devpath[PATH_MAX];
+        int is_ufs = gpt_utils_is_ufs_device();
+        if (partitions.empty()) {
                 fprintf(stderr, "%s: Invalid ptn list\n", __func__);
-                goto error;
+                return nullopt;
         }
-        //Go through the passed in list
-        for (uint32_t i = 0; i < ptn_list.size(); i++)
-        {
-                //Key in the map is the path to the device that holds the
-                //partition
-                if (get_dev_path_from_partition_name(ptn_list[i].c_str(),
-                                devpath,
-                                sizeof(devpath))) {
-                        //Not necessarily an error. The partition may just
-                        //not be present.
-                        continue;
-                }
-                string path = devpath;
-                it = partition_map.find(path);
-                if (it != partition_map.end()) {
-                        it->second.push_back(ptn_list[i]);
-                } else {
-                        vector<string> str_vec;
-                        str_vec.push_back( ptn_list[i]);
-                        partition_map.insert(pair<string, vector<string>>
-                                        (path, str_vec));
+        //On UFS the partitions are spread over several LUNs. Use the map
+        //of the whole by-name directory instead of resolving each name on
+        //its own, falling back to the latter if the directory can't be read.
+        if (is_ufs)
+                disks = topo_get_disks();
+        if (!disks) {
+                //Map of just the listed partitions, which the views then
+                //point into
+                own = make_shared<gpt_disk_map>();
+                for (string_view name : partitions) {
+                        string partname(name);
+                        if (!is_ufs)
+                                strlcpy(devpath, backend.emmc_disk,
+                                                sizeof(devpath));
+                        else if (get_dev_path_from_partition_name(
+                                                partname.c_str(),
+                                                devpath,
+                                                sizeof(devpath)))
+                                continue;
+                        (*own)[partname] = devpath;
                 }
-                memset(devpath, '\0', sizeof(devpath));
+                disks = own;
         }
-        return 0;
-error:
-        return -1;
+        pm.locations_.reserve(partitions.size());
+        for (string_view name : partitions) {
+                auto disk = disks->find(name);
+                //Not necessarily an error. The partition may just not be
+                //present.
+                if (disk == disks->end())
+                        continue;
+                pm.locations_.push_back({ disk->second, disk->first });
+        }
+        stable_sort(pm.locations_.begin(), pm.locations_.end(),
+                        [](const Location& a, const Location& b) {
+                                return a.disk < b.disk;
+                        });
+        pm.storage_ = disks;
+        return pm;
 }
 
-//Get the block size of the disk represented by decsriptor fd
-static uint32_t gpt_get_block_size(int fd)
+span<const PartitionMap::Location> PartitionMap::OnDisk(string_view disk) const
 {
-        uint32_t block_size = 0;
-        if (fd < 0) {
-                ALOGE("%s: invalid descriptor",
-                                __func__);
-                goto error;
-        }
-        if (ioctl(fd, BLKSSZGET, &block_size) != 0) {
-                ALOGE("%s: Failed to get GPT dev block size : %s",
-                                __func__,
-                                strerror(errno));
-                goto error;
-        }
-        return block_size;
-error:
+        auto range = equal_range(locations_.begin(), locations_.end(),
+                        Location{ disk, {} },
+                        [](const Location& a, const Location& b) {
+                                return a.disk < b.disk;
+                        });
+        return { range.first, range.second };
+}
+
+vector<string_view> PartitionMap::Disks() const
+{
+        vector<string_view> disks;
+        for (const Location& loc : locations_)
+                if (disks.empty() || disks.back() != loc.disk)
+                        disks.push_back(loc.disk);
+        return disks;
+}
+
+}  // namespace gpt
+
+//Kept for callers of the map based interface, which copies every name
+int gpt_utils_get_partition_map(vector<string>& ptn_list,
+                map<string, vector<string>>& partition_map) {
+        vector<string_view> names(ptn_list.begin(), ptn_list.end());
+        optional<gpt::PartitionMap> pm = gpt::PartitionMap::Build(names);
+        if (!pm)
+                return -1;
+        for (const gpt::PartitionMap::Location& loc : pm->Locations())
+                partition_map[string(loc.disk)].emplace_back(loc.partition);
         return 0;
 }
 
+//Byte offset of the primary or secondary GPT header of an opened disk
+static int64_t gpt_disk_hdr_offset(struct gpt_disk *disk,
+                enum gpt_instance instance)
+{
+        if (instance == PRIMARY_GPT)
+                return disk->block_size;
+        return (int64_t)disk->dev_size - disk->block_size;
+}
+
 //Write the GPT header present in the passed in buffer back to the
-//disk represented by fd
-static int gpt_set_header(uint8_t *gpt_header, int fd,
+//opened disk
+static int gpt_set_header(uint8_t *gpt_header, struct gpt_disk *disk,
                 enum gpt_instance instance)
 {
-        uint32_t block_size = 0;
         off64_t gpt_header_offset = 0;
-        if (!gpt_header || fd < 0) {
+        if (!gpt_header || disk->fd < 0) {
                 ALOGE("%s: Invalid arguments",
                                 __func__);
                 goto error;
         }
-        block_size = gpt_get_block_size(fd);
-        if (block_size == 0) {
-                ALOGE("%s: Failed to get block size", __func__);
-                goto error;
-        }
-        if (instance == PRIMARY_GPT)
-                gpt_header_offset = block_size;
-        else
-                gpt_header_offset = lseek64(fd, 0, SEEK_END) - block_size;
+        gpt_header_offset = gpt_disk_hdr_offset(disk, instance);
         if (gpt_header_offset <= 0) {
                 ALOGE("%s: Failed to get gpt header offset",__func__);
                 goto error;
         }
-        if (blk_rw(fd, 1, gpt_header_offset, gpt_header, block_size)) {
+        if (blk_write(disk->direct_fd, disk->fd, disk->block_size,
+                                gpt_header_offset, gpt_header,
+                                disk->block_size)) {
                 ALOGE("%s: Failed to write back GPT header", __func__);
                 goto error;
         }
@@ -1176,153 +3122,142 @@ error:
         return -1;
 }
 
-//Read out the GPT header for the disk that contains the partition partname
-static uint8_t* gpt_get_header(const char *partname, enum gpt_instance instance)
+//Size of the partition entry array described by a GPT header
+static uint32_t gpt_hdr_pentry_arr_size(const uint8_t *hdr)
 {
-        uint8_t* hdr = NULL;
-        char devpath[PATH_MAX] = {0};
-        int64_t hdr_offset = 0;
-        uint32_t block_size = 0;
-        int fd = -1;
-        if (!partname) {
-                ALOGE("%s: Invalid partition name", __func__);
-                goto error;
-        }
-        if (get_dev_path_from_partition_name(partname, devpath, sizeof(devpath))
-                        != 0) {
-                ALOGE("%s: Failed to resolve path for %s",
-                                __func__,
-                                partname);
-                goto error;
-        }
-        fd = open(devpath, O_RDWR);
-        if (fd < 0) {
-                ALOGE("%s: Failed to open %s : %s",
-                                __func__,
-                                devpath,
-                                strerror(errno));
-                goto error;
-        }
-        block_size = gpt_get_block_size(fd);
-        if (block_size == 0)
-        {
-                ALOGE("%s: Failed to get gpt block size for %s",
-                                __func__,
-                                partname);
-                goto error;
-        }
+        return GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) *
+                GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
+}
 
-        hdr = (uint8_t*)malloc(block_size);
-        if (!hdr) {
-                ALOGE("%s: Failed to allocate memory for gpt header",
-                                __func__);
-        }
-        if (instance == PRIMARY_GPT)
-                hdr_offset = block_size;
-        else {
-                hdr_offset = lseek64(fd, 0, SEEK_END) - block_size;
-        }
-        if (hdr_offset < 0) {
-                ALOGE("%s: Failed to get gpt header offset",
+//Read both GPT headers and both partition entry arrays of the opened
+//disk. On a standard layout this is two reads: LBA1 together with the
+//primary entries that follow it, and the backup entries together with
+//the backup header in the last LBA that follows them.
+static int gpt_disk_load_tables(struct gpt_disk *disk)
+{
+        uint32_t bs = disk->block_size;
+        uint32_t arr_size = 0;
+        uint32_t arr_bak_size = 0;
+        uint32_t arr_alloc = 0;
+        uint64_t last_lba = disk->dev_size / bs - 1;
+        uint64_t arr_bak_lba = 0;
+        struct iovec iov[2];
+
+        disk->hdr = (uint8_t*)malloc(bs);
+        disk->hdr_bak = (uint8_t*)malloc(bs);
+        disk->pentry_arr = (uint8_t*)calloc(1,
+                        DIV_ROUND_UP(GPT_STD_PENTRY_ARR_SIZE, bs) * bs);
+        if (!disk->hdr || !disk->hdr_bak || !disk->pentry_arr) {
+                ALOGE("%s: Failed to allocate memory for gpt tables",
                                 __func__);
                 goto error;
         }
-        if (blk_rw(fd, 0, hdr_offset, hdr, block_size)) {
-                ALOGE("%s: Failed to read GPT header from device",
+        //Primary header and (speculatively) the entries right after it
+        iov[0].iov_base = disk->hdr;
+        iov[0].iov_len = bs;
+        iov[1].iov_base = disk->pentry_arr;
+        iov[1].iov_len = DIV_ROUND_UP(GPT_STD_PENTRY_ARR_SIZE, bs) * bs;
+        if (blk_readv(disk->fd, bs, iov, 2)) {
+                ALOGE("%s: Failed to read primary GPT from device",
                                 __func__);
                 goto error;
         }
-        close(fd);
-        return hdr;
-error:
-        if (fd >= 0)
-                close(fd);
-        if (hdr)
-                free(hdr);
-        return NULL;
-}
-
-//Returns the partition entry array based on the
-//passed in buffer which contains the gpt header.
-//The fd here is the descriptor for the 'disk' which
-//holds the partition
-static uint8_t* gpt_get_pentry_arr(uint8_t *hdr, int fd)
-{
-        uint64_t pentries_start = 0;
-        uint32_t pentry_size = 0;
-        uint32_t block_size = 0;
-        uint32_t pentries_arr_size = 0;
-        uint8_t *pentry_arr = NULL;
-        int rc = 0;
-        if (!hdr) {
-                ALOGE("%s: Invalid header", __func__);
-                goto error;
-        }
-        if (fd < 0) {
-                ALOGE("%s: Invalid fd", __func__);
-                goto error;
+        arr_size = gpt_hdr_pentry_arr_size(disk->hdr);
+        if (GET_8_BYTES(disk->hdr + PENTRIES_OFFSET) != GPT_STD_PENTRIES_LBA ||
+                        arr_size > GPT_STD_PENTRY_ARR_SIZE) {
+                free(disk->pentry_arr);
+                disk->pentry_arr = (uint8_t*)calloc(1, arr_size);
+                if (!disk->pentry_arr ||
+                                blk_rw(disk->fd, 0,
+                                        GET_8_BYTES(disk->hdr + PENTRIES_OFFSET) * bs,
+                                        disk->pentry_arr,
+                                        arr_size)) {
+                        ALOGE("%s: Failed to read partition entry array",
+                                        __func__);
+                        goto error;
+                }
         }
-        block_size = gpt_get_block_size(fd);
-        if (!block_size) {
-                ALOGE("%s: Failed to get gpt block size for",
-                                __func__);
+        //Backup entries are expected to end right before the last LBA,
+        //where the backup header lives
+        arr_alloc = DIV_ROUND_UP(arr_size, bs) * bs;
+        if (last_lba < 1 + arr_alloc / bs) {
+                ALOGE("%s: Device too small for its GPT", __func__);
                 goto error;
         }
-        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
-        pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
-        pentries_arr_size =
-                GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) * pentry_size;
-        pentry_arr = (uint8_t*)calloc(1, pentries_arr_size);
-        if (!pentry_arr) {
+        arr_bak_lba = last_lba - arr_alloc / bs;
+        disk->pentry_arr_bak = (uint8_t*)calloc(1, arr_alloc);
+        if (!disk->pentry_arr_bak) {
                 ALOGE("%s: Failed to allocate memory for partition array",
                                 __func__);
                 goto error;
         }
-        rc = blk_rw(fd, 0,
-                        pentries_start,
-                        pentry_arr,
-                        pentries_arr_size);
-        if (rc) {
-                ALOGE("%s: Failed to read partition entry array",
+        iov[0].iov_base = disk->pentry_arr_bak;
+        iov[0].iov_len = arr_alloc;
+        iov[1].iov_base = disk->hdr_bak;
+        iov[1].iov_len = bs;
+        if (blk_readv(disk->fd, arr_bak_lba * bs, iov, 2)) {
+                ALOGE("%s: Failed to read backup GPT from device",
                                 __func__);
                 goto error;
         }
-        return pentry_arr;
+        arr_bak_size = gpt_hdr_pentry_arr_size(disk->hdr_bak);
+        if (GET_8_BYTES(disk->hdr_bak + PENTRIES_OFFSET) != arr_bak_lba ||
+                        arr_bak_size > arr_alloc) {
+                free(disk->pentry_arr_bak);
+                disk->pentry_arr_bak = (uint8_t*)calloc(1,
+                                arr_bak_size > arr_size ? arr_bak_size : arr_size);
+                if (!disk->pentry_arr_bak ||
+                                blk_rw(disk->fd, 0,
+                                        GET_8_BYTES(disk->hdr_bak + PENTRIES_OFFSET) * bs,
+                                        disk->pentry_arr_bak,
+                                        arr_bak_size)) {
+                        ALOGE("%s: Failed to read backup partition entry array",
+                                        __func__);
+                        goto error;
+                }
+        }
+        return 0;
 error:
-        if (pentry_arr)
-                free(pentry_arr);
-        return NULL;
+        return -1;
 }
 
-static int gpt_set_pentry_arr(uint8_t *hdr, int fd, uint8_t* arr)
+//Write back the sectors of the partition entry array arr (located by hdr)
+//that are marked in the dirty bitmap, one write per run of consecutive
+//dirty sectors. The array and its bitmap cover disk->pentry_arr_size
+//bytes, whatever hdr claims.
+static int gpt_set_pentry_sectors(uint8_t *hdr, struct gpt_disk *disk,
+                uint8_t* arr, const uint8_t *dirty)
 {
-        uint32_t block_size = 0;
         uint64_t pentries_start = 0;
-        uint32_t pentry_size = 0;
-        uint32_t pentries_arr_size = 0;
-        int rc = 0;
-        if (!hdr || fd < 0 || !arr) {
+        uint32_t pentries_arr_size = disk->pentry_arr_size;
+        uint32_t num_sectors = 0;
+        uint32_t bs = disk->block_size;
+        uint32_t first, last;
+        if (!hdr || disk->fd < 0 || !arr || !dirty) {
                 ALOGE("%s: Invalid argument", __func__);
                 goto error;
         }
-        block_size = gpt_get_block_size(fd);
-        if (!block_size) {
-                ALOGE("%s: Failed to get gpt block size for",
-                                __func__);
-                goto error;
-        }
-        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
-        pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
-        pentries_arr_size =
-                GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) * pentry_size;
-        rc = blk_rw(fd, 1,
-                        pentries_start,
-                        arr,
-                        pentries_arr_size);
-        if (rc) {
-                ALOGE("%s: Failed to read partition entry array",
-                                __func__);
-                goto error;
+        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * bs;
+        num_sectors = DIV_ROUND_UP(pentries_arr_size, bs);
+        for (first = 0; first < num_sectors; first = last) {
+                uint32_t len;
+                if (!(dirty[first / 8] & (1 << (first % 8)))) {
+                        last = first + 1;
+                        continue;
+                }
+                for (last = first + 1; last < num_sectors &&
+                                (dirty[last / 8] & (1 << (last % 8))); last++)
+                        ;
+                len = (last == num_sectors) ?
+                        pentries_arr_size - first * bs : (last - first) * bs;
+                if (blk_write(disk->direct_fd, disk->fd, bs,
+                                        pentries_start + (uint64_t)first * bs,
+                                        arr + (size_t)first * bs,
+                                        len)) {
+                        ALOGE("%s: Failed to write partition entry array",
+                                        __func__);
+                        goto error;
+                }
         }
         return 0;
 error:
@@ -1341,15 +3276,139 @@ struct gpt_disk * gpt_disk_alloc()
                 goto end;
         }
         memset(disk, 0, sizeof(struct gpt_disk));
+        disk->fd = -1;
+        disk->direct_fd = -1;
 end:
         return disk;
 }
 
-//Free previously allocated/initialized handle
-void gpt_disk_free(struct gpt_disk *disk)
+//Set up tracking for an array of count partition entries stored in
+//num_sectors disk sectors
+static int gpt_pentry_track_init(struct gpt_pentry_track *track,
+                uint32_t count,
+                uint32_t num_sectors)
 {
-        if (!disk)
+        uint8_t *buf = NULL;
+        buf = (uint8_t*)calloc(1, count * 2 * sizeof(uint32_t) +
+                        (count + 7) / 8 + (num_sectors + 7) / 8);
+        if (!buf) {
+                ALOGE("%s: Failed to allocate memory", __func__);
+                return -1;
+        }
+        track->crc = (uint32_t*)buf;
+        track->idx = track->crc + count;
+        track->map = (uint8_t*)(track->idx + count);
+        track->dirty = track->map + (count + 7) / 8;
+        track->num = 0;
+        return 0;
+}
+
+static void gpt_pentry_track_free(struct gpt_pentry_track *track)
+{
+        //crc is the start of the single allocation
+        if (track->crc)
+                free(track->crc);
+        memset(track, 0, sizeof(*track));
+}
+
+//Start tracking the entry at index idx of arr, remembering its current CRC
+static void gpt_pentry_track_add(struct gpt_pentry_track *track,
+                const uint8_t *arr,
+                uint32_t idx,
+                uint32_t pentry_size)
+{
+        if (!track->map || (track->map[idx / 8] & (1 << (idx % 8))))
                 return;
+        track->map[idx / 8] |= (1 << (idx % 8));
+        track->crc[idx] = gpt_crc32(0, arr + idx * pentry_size,
+                        pentry_size);
+        track->idx[track->num++] = idx;
+}
+
+static int gpt_pentry_view_init(struct gpt_pentry_view *view,
+                const struct gpt_pentry_index *index)
+{
+        uint32_t count = index->num_entries;
+        uint8_t *buf = NULL;
+        buf = (uint8_t*)calloc(1, count * (3 * sizeof(uint64_t) +
+                                TYPE_GUID_SIZE));
+        if (!buf) {
+                ALOGE("%s: Failed to allocate memory", __func__);
+                return -1;
+        }
+        view->first_lba = (uint64_t*)buf;
+        view->last_lba = view->first_lba + count;
+        view->attr = view->last_lba + count;
+        view->type_guid = (uint8_t (*)[TYPE_GUID_SIZE])(view->attr + count);
+        view->name = index->name;
+        view->num = count;
+        return 0;
+}
+
+static void gpt_pentry_view_free(struct gpt_pentry_view *view)
+{
+        //first_lba is the start of the single allocation
+        if (view->first_lba)
+                free(view->first_lba);
+        memset(view, 0, sizeof(*view));
+}
+
+//Refresh the decoded fields of the entry at index idx of arr
+static void gpt_pentry_view_decode(struct gpt_pentry_view *view,
+                const uint8_t *arr,
+                uint32_t idx,
+                uint32_t pentry_size)
+{
+        const uint8_t *pentry = arr + idx * pentry_size;
+        view->first_lba[idx] = GET_8_BYTES(pentry + FIRST_LBA_OFFSET);
+        view->last_lba[idx] = GET_8_BYTES(pentry + LAST_LBA_OFFSET);
+        view->attr[idx] = GET_8_BYTES(pentry + ATTRIBUTE_FLAG_OFFSET);
+        memcpy(view->type_guid[idx], pentry + TYPE_GUID_OFFSET,
+                        TYPE_GUID_SIZE);
+}
+
+//Patch arr_crc, the CRC of the whole of arr, for every tracked entry whose
+//contents changed since the last call, mark the sectors holding those
+//entries dirty and refresh their decoded view and name index slot.
+static uint32_t gpt_pentry_track_update(struct gpt_pentry_track *track,
+                struct gpt_pentry_view *view,
+                struct gpt_pentry_index *index,
+                const uint8_t *arr,
+                uint32_t arr_size,
+                uint32_t pentry_size,
+                uint32_t block_size,
+                uint32_t arr_crc)
+{
+        for (uint32_t i = 0; i < track->num; i++) {
+                uint32_t idx = track->idx[i];
+                uint32_t crc = gpt_crc32(0, arr + idx * pentry_size,
+                                pentry_size);
+                if (crc == track->crc[idx])
+                        continue;
+                arr_crc = sparse_crc32_combine(crc ^ track->crc[idx],
+                                arr_crc,
+                                arr_size - (idx + 1) * pentry_size);
+                track->crc[idx] = crc;
+                gpt_pentry_view_decode(view, arr, idx, pentry_size);
+                gpt_pentry_index_rename(index, arr + idx * pentry_size, idx);
+                for (uint32_t sec = idx * pentry_size / block_size;
+                                sec <= ((idx + 1) * pentry_size - 1) / block_size;
+                                sec++)
+                        track->dirty[sec / 8] |= (1 << (sec % 8));
+        }
+        return arr_crc;
+}
+
+//Release everything a gpt_disk_get_disk_info() call set up and return
+//the handle to its freshly allocated state
+static void gpt_disk_release(struct gpt_disk *disk)
+{
+        gpt_pentry_track_free(&disk->track);
+        gpt_pentry_track_free(&disk->track_bak);
+        gpt_pentry_index_free(&disk->index);
+        gpt_pentry_index_free(&disk->index_bak);
+        gpt_pentry_view_free(&disk->view);
+        gpt_pentry_view_free(&disk->view_bak);
         if (disk->hdr)
                 free(disk->hdr);
         if (disk->hdr_bak)
@@ -1358,39 +3417,44 @@ void gpt_disk_free(struct gpt_disk *disk)
                 free(disk->pentry_arr);
         if (disk->pentry_arr_bak)
                 free(disk->pentry_arr_bak);
+        if (disk->fd >= 0)
+                close(disk->fd);
+        if (disk->direct_fd >= 0)
+                close(disk->direct_fd);
+        memset(disk, 0, sizeof(struct gpt_disk));
+        disk->fd = -1;
+        disk->direct_fd = -1;
+}
+
+//Free previously allocated/initialized handle
+void gpt_disk_free(struct gpt_disk *disk)
+{
+        if (!disk)
+                return;
+        gpt_disk_release(disk);
         free(disk);
         return;
 }
 
 //fills up the passed in gpt_disk struct with information about the
 //disk represented by path dev. Returns 0 on success and -1 on error.
+//The disk is opened once here and the descriptor, block size and size
+//are kept for the header/entry reads and gpt_disk_commit().
 int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *dsk)
 {
         struct gpt_disk *disk = NULL;
-        int fd = -1;
         uint32_t gpt_header_size = 0;
+        off64_t dev_size = 0;
+        int lock_fd = -1;
+        int publish = 0;
 
         if (!dsk || !dev) {
                 ALOGE("%s: Invalid arguments", __func__);
                 goto error;
         }
         disk = dsk;
-        disk->hdr = gpt_get_header(dev, PRIMARY_GPT);
-        if (!disk->hdr) {
-                ALOGE("%s: Failed to get primary header", __func__);
-                goto error;
-        }
-        gpt_header_size = GET_4_BYTES(disk->hdr + HEADER_SIZE_OFFSET);
-        disk->hdr_crc = crc32(0, disk->hdr, gpt_header_size);
-        disk->hdr_bak = gpt_get_header(dev, SECONDARY_GPT);
-        if (!disk->hdr_bak) {
-                ALOGE("%s: Failed to get backup header", __func__);
-                goto error;
-        }
-        disk->hdr_bak_crc = crc32(0, disk->hdr_bak, gpt_header_size);
-
-        //Descriptor for the block device. We will use this for further
-        //modifications to the partition table
+        //The handle may be reused for another disk
+        gpt_disk_release(disk);
         if (get_dev_path_from_partition_name(dev,
                                 disk->devpath,
                                 sizeof(disk->devpath)) != 0) {
@@ -1399,62 +3463,318 @@ int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *dsk)
                                 dev);
                 goto error;
         }
-        fd = open(disk->devpath, O_RDWR);
-        if (fd < 0) {
+        disk->fd = open(disk->devpath, O_RDWR);
+        if (disk->fd < 0) {
                 ALOGE("%s: Failed to open %s: %s",
                                 __func__,
                                 disk->devpath,
                                 strerror(errno));
                 goto error;
         }
-        disk->pentry_arr = gpt_get_pentry_arr(disk->hdr, fd);
-        if (!disk->pentry_arr) {
-                ALOGE("%s: Failed to obtain partition entry array",
-                                __func__);
+        disk->block_size = gpt_get_block_size(disk->fd);
+        if (disk->block_size == 0) {
+                ALOGE("%s: Failed to get gpt block size for %s",
+                                __func__,
+                                dev);
                 goto error;
         }
-        disk->pentry_arr_bak = gpt_get_pentry_arr(disk->hdr_bak, fd);
-        if (!disk->pentry_arr_bak) {
-                ALOGE("%s: Failed to obtain backup partition entry array",
-                                __func__);
+        dev_size = lseek64(disk->fd, 0, SEEK_END);
+        if (dev_size < 2 * (off64_t)disk->block_size) {
+                ALOGE("%s: Failed to get size of %s",
+                                __func__,
+                                disk->devpath);
                 goto error;
         }
+        disk->dev_size = dev_size;
+        //Tables already read by another process this boot are taken from
+        //the snapshot. Otherwise they are read and published, unless a GPT
+        //update holds the lock: what is read then may be half written.
+        //Taking them from the snapshot needs no lock, as updates drop it
+        //before writing.
+        if (gpt_snapshot_load_disk(disk)) {
+                lock_fd = gpt_snapshot_lock(LOCK_EX | LOCK_NB);
+                if (gpt_disk_load_tables(disk)) {
+                        ALOGE("%s: Failed to read GPT of %s",
+                                        __func__,
+                                        disk->devpath);
+                        goto error;
+                }
+                publish = lock_fd >= 0;
+        }
+        gpt_header_size = GET_4_BYTES(disk->hdr + HEADER_SIZE_OFFSET);
+        disk->hdr_crc = gpt_crc32(0, disk->hdr, gpt_header_size);
+        disk->hdr_bak_crc = gpt_crc32(0, disk->hdr_bak, gpt_header_size);
         disk->pentry_size = GET_4_BYTES(disk->hdr + PENTRY_SIZE_OFFSET);
         disk->pentry_arr_size =
                 GET_4_BYTES(disk->hdr + PARTITION_COUNT_OFFSET) *
                 disk->pentry_size;
-        disk->pentry_arr_crc = GET_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET);
-        disk->pentry_arr_bak_crc = GET_4_BYTES(disk->hdr_bak +
-                        PARTITION_CRC_OFFSET);
-        disk->block_size = gpt_get_block_size(fd);
-        close(fd);
+        //Hash the arrays as read rather than trusting the header fields;
+        //gpt_disk_update_crc() only patches these for modified entries.
+        disk->pentry_arr_crc = gpt_crc32(0, disk->pentry_arr,
+                        disk->pentry_arr_size);
+        disk->pentry_arr_bak_crc = gpt_crc32(0, disk->pentry_arr_bak,
+                        disk->pentry_arr_size);
+        if (!disk->pentry_size ||
+                        gpt_pentry_track_init(&disk->track,
+                                disk->pentry_arr_size / disk->pentry_size,
+                                DIV_ROUND_UP(disk->pentry_arr_size,
+                                        disk->block_size)) ||
+                        gpt_pentry_track_init(&disk->track_bak,
+                                disk->pentry_arr_size / disk->pentry_size,
+                                DIV_ROUND_UP(disk->pentry_arr_size,
+                                        disk->block_size))) {
+                ALOGE("%s: Failed to set up partition entry tracking",
+                                __func__);
+                goto error;
+        }
+        if (gpt_pentry_index_build(&disk->index,
+                                disk->pentry_arr,
+                                disk->pentry_arr + disk->pentry_arr_size,
+                                disk->pentry_size) ||
+                        gpt_pentry_index_build(&disk->index_bak,
+                                disk->pentry_arr_bak,
+                                disk->pentry_arr_bak + disk->pentry_arr_size,
+                                disk->pentry_size)) {
+                ALOGE("%s: Failed to build partition name index",
+                                __func__);
+                goto error;
+        }
+        if (gpt_pentry_view_init(&disk->view, &disk->index) ||
+                        gpt_pentry_view_init(&disk->view_bak,
+                                &disk->index_bak)) {
+                ALOGE("%s: Failed to set up partition entry view",
+                                __func__);
+                goto error;
+        }
+        if (publish)
+                gpt_snapshot_publish(disk, NULL, NULL, NULL);
+        gpt_snapshot_unlock(lock_fd);
+        lock_fd = -1;
+        for (uint32_t i = 0; i < disk->view.num; i++) {
+                gpt_pentry_view_decode(&disk->view, disk->pentry_arr, i,
+                                disk->pentry_size);
+                gpt_pentry_view_decode(&disk->view_bak, disk->pentry_arr_bak,
+                                i, disk->pentry_size);
+        }
         disk->is_initialized = GPT_DISK_INIT_MAGIC;
         return 0;
 error:
-        if (fd >= 0)
-                close(fd);
+        gpt_snapshot_unlock(lock_fd);
+        if (disk && disk->fd >= 0) {
+                close(disk->fd);
+                disk->fd = -1;
+        }
         return -1;
 }
 
+//Index of the entry called partname (or partname-bak) in the given
+//instance of the disk, UINT32_MAX if there is none
+static uint32_t gpt_disk_seek_pentry(struct gpt_disk *disk,
+                const char *partname,
+                enum gpt_instance instance)
+{
+        if (!disk || !partname || disk->is_initialized != GPT_DISK_INIT_MAGIC) {
+                ALOGE("%s: Invalid argument",__func__);
+                return UINT32_MAX;
+        }
+        return gpt_pentry_index_seek((instance == PRIMARY_GPT) ?
+                        &disk->index : &disk->index_bak,
+                        partname, -1);
+}
+
 //Get pointer to partition entry from a allocated gpt_disk structure
 uint8_t* gpt_disk_get_pentry(struct gpt_disk *disk,
                 const char *partname,
                 enum gpt_instance instance)
 {
         uint8_t *ptn_arr = NULL;
-        if (!disk || !partname || disk->is_initialized != GPT_DISK_INIT_MAGIC) {
-                ALOGE("%s: Invalid argument",__func__);
+        uint32_t idx;
+        idx = gpt_disk_seek_pentry(disk, partname, instance);
+        if (idx == UINT32_MAX)
                 goto error;
-        }
         ptn_arr = (instance == PRIMARY_GPT) ?
                 disk->pentry_arr : disk->pentry_arr_bak;
-        return (gpt_pentry_seek(partname, ptn_arr,
-                        ptn_arr + disk->pentry_arr_size ,
-                        disk->pentry_size));
+        //The caller may modify the entry through the returned pointer
+        gpt_pentry_track_add((instance == PRIMARY_GPT) ?
+                        &disk->track : &disk->track_bak,
+                        ptn_arr,
+                        idx,
+                        disk->pentry_size);
+        return ptn_arr + idx * disk->pentry_size;
 error:
         return NULL;
 }
 
+//Get read only pointer to partition entry from a allocated gpt_disk
+//structure
+const uint8_t* gpt_disk_find_pentry(struct gpt_disk *disk,
+                const char *partname,
+                enum gpt_instance instance)
+{
+        uint32_t idx;
+        idx = gpt_disk_seek_pentry(disk, partname, instance);
+        if (idx == UINT32_MAX)
+                return NULL;
+        return ((instance == PRIMARY_GPT) ?
+                        disk->pentry_arr : disk->pentry_arr_bak) +
+                idx * disk->pentry_size;
+}
+
+//Decoded view of the partition entries of one instance of the disk
+const struct gpt_pentry_view* gpt_disk_get_view(struct gpt_disk *disk,
+                enum gpt_instance instance)
+{
+        if (!disk || disk->is_initialized != GPT_DISK_INIT_MAGIC) {
+                ALOGE("%s: Invalid argument", __func__);
+                return NULL;
+        }
+        return (instance == PRIMARY_GPT) ? &disk->view : &disk->view_bak;
+}
+
+//Fields of a partition entry that differ between entries a and b
+static uint32_t gpt_pentry_diff_fields(const uint8_t *a, const uint8_t *b,
+                uint32_t pentry_size)
+{
+        uint32_t fields = 0;
+        if (memcmp(a + TYPE_GUID_OFFSET, b + TYPE_GUID_OFFSET,
+                                TYPE_GUID_SIZE))
+                fields |= GPT_PENTRY_DIFF_TYPE_GUID;
+        if (memcmp(a + UNIQUE_GUID_OFFSET, b + UNIQUE_GUID_OFFSET,
+                                FIRST_LBA_OFFSET - UNIQUE_GUID_OFFSET))
+                fields |= GPT_PENTRY_DIFF_UNIQUE_GUID;
+        if (memcmp(a + FIRST_LBA_OFFSET, b + FIRST_LBA_OFFSET,
+                                ATTRIBUTE_FLAG_OFFSET - FIRST_LBA_OFFSET))
+                fields |= GPT_PENTRY_DIFF_LBA;
+        if (memcmp(a + ATTRIBUTE_FLAG_OFFSET, b + ATTRIBUTE_FLAG_OFFSET,
+                                PARTITION_NAME_OFFSET - ATTRIBUTE_FLAG_OFFSET))
+                fields |= GPT_PENTRY_DIFF_ATTR;
+        if (memcmp(a + PARTITION_NAME_OFFSET, b + PARTITION_NAME_OFFSET,
+                                MAX_GPT_NAME_SIZE))
+                fields |= GPT_PENTRY_DIFF_NAME;
+        if (pentry_size > PARTITION_NAME_OFFSET + MAX_GPT_NAME_SIZE &&
+                        memcmp(a + PARTITION_NAME_OFFSET + MAX_GPT_NAME_SIZE,
+                                b + PARTITION_NAME_OFFSET + MAX_GPT_NAME_SIZE,
+                                pentry_size - PARTITION_NAME_OFFSET -
+                                MAX_GPT_NAME_SIZE))
+                fields |= GPT_PENTRY_DIFF_OTHER;
+        return fields;
+}
+
+//Compare the primary and backup partition entry arrays. Runs of
+//GPT_DIFF_CHUNK_ENTRIES entries are compared with one memcmp, which libc
+//implements with its widest vector loads; only the runs that differ are
+//looked at entry by entry.
+int gpt_disk_diff_pentries(struct gpt_disk *disk,
+                struct gpt_pentry_diff *diffs,
+                uint32_t max_diffs)
+{
+        uint32_t size = 0;
+        uint32_t num = 0;
+        uint32_t num_bak = 0;
+        uint32_t common = 0;
+        uint32_t chunk = 0;
+        uint32_t i, j;
+        int count = 0;
+        if (!disk || disk->is_initialized != GPT_DISK_INIT_MAGIC ||
+                        (!diffs && max_diffs)) {
+                ALOGE("%s: Invalid argument", __func__);
+                return -1;
+        }
+        size = disk->pentry_size;
+        num = disk->pentry_arr_size / size;
+        num_bak = GET_4_BYTES(disk->hdr_bak + PARTITION_COUNT_OFFSET);
+        if (GET_4_BYTES(disk->hdr_bak + PENTRY_SIZE_OFFSET) != size) {
+                ALOGE("%s: Primary and backup entry sizes differ", __func__);
+                return -1;
+        }
+        common = num < num_bak ? num : num_bak;
+        chunk = GPT_DIFF_CHUNK_ENTRIES * size;
+        for (i = 0; i < common; i += GPT_DIFF_CHUNK_ENTRIES) {
+                uint32_t end = i + GPT_DIFF_CHUNK_ENTRIES;
+                if (end > common)
+                        end = common;
+                if (end - i == GPT_DIFF_CHUNK_ENTRIES &&
+                                !memcmp(disk->pentry_arr + i * size,
+                                        disk->pentry_arr_bak + i * size,
+                                        chunk))
+                        continue;
+                for (j = i; j < end; j++) {
+                        const uint8_t *a = disk->pentry_arr + j * size;
+                        const uint8_t *b = disk->pentry_arr_bak + j * size;
+                        if (!memcmp(a, b, size))
+                                continue;
+                        if ((uint32_t)count < max_diffs) {
+                                diffs[count].index = j;
+                                diffs[count].fields =
+                                        gpt_pentry_diff_fields(a, b, size);
+                        }
+                        count++;
+                }
+        }
+        //Entries only one of the tables has, unless they are unused
+        for (j = common; j < num || j < num_bak; j++) {
+                const uint8_t *e = (j < num) ? disk->pentry_arr + j * size :
+                        disk->pentry_arr_bak + j * size;
+                for (i = 0; i < size && !e[i]; i++)
+                        ;
+                if (i == size)
+                        continue;
+                if ((uint32_t)count < max_diffs) {
+                        diffs[count].index = j;
+                        diffs[count].fields = GPT_PENTRY_DIFF_MISSING;
+                }
+                count++;
+        }
+        return count;
+}
+
+int gpt_disk_update_pentry(struct gpt_disk *disk,
+                enum gpt_instance instance,
+                const uint8_t *pentry,
+                uint32_t offset,
+                const void *data,
+                uint32_t len)
+{
+        uint8_t *ptn_arr = NULL;
+        uint32_t idx;
+        if (!disk || !pentry || !data ||
+                        disk->is_initialized != GPT_DISK_INIT_MAGIC ||
+                        offset + len > disk->pentry_size) {
+                ALOGE("%s: Invalid argument", __func__);
+                goto error;
+        }
+        ptn_arr = (instance == PRIMARY_GPT) ?
+                disk->pentry_arr : disk->pentry_arr_bak;
+        if (pentry < ptn_arr || pentry >= ptn_arr + disk->pentry_arr_size ||
+                        (pentry - ptn_arr) % disk->pentry_size) {
+                ALOGE("%s: Entry does not belong to the disk", __func__);
+                goto error;
+        }
+        idx = (pentry - ptn_arr) / disk->pentry_size;
+        //Remember the entry's CRC before it changes
+        gpt_pentry_track_add((instance == PRIMARY_GPT) ?
+                        &disk->track : &disk->track_bak,
+                        ptn_arr,
+                        idx,
+                        disk->pentry_size);
+        memcpy(ptn_arr + idx * disk->pentry_size + offset, data, len);
+        gpt_pentry_view_decode((instance == PRIMARY_GPT) ?
+                        &disk->view : &disk->view_bak,
+                        ptn_arr,
+                        idx,
+                        disk->pentry_size);
+        //Lookups must find the entry under the name it now has
+        if (offset < PARTITION_NAME_OFFSET + MAX_GPT_NAME_SIZE &&
+                        offset + len > PARTITION_NAME_OFFSET)
+                gpt_pentry_index_rename((instance == PRIMARY_GPT) ?
+                                &disk->index : &disk->index_bak,
+                                ptn_arr + idx * disk->pentry_size,
+                                idx);
+        return 0;
+error:
+        return -1;
+}
+
 //Update CRC values for the various components of the gpt_disk
 //structure. This function should be called after any of the fields
 //have been updated before the structure contents are written back to
@@ -1466,14 +3786,25 @@ int gpt_disk_update_crc(struct gpt_disk *disk)
                 ALOGE("%s: invalid argument", __func__);
                 goto error;
         }
-        //Recalculate the CRC of the primary partiton array
-        disk->pentry_arr_crc = crc32(0,
+        //Patch the CRC of the primary partiton array for the entries that
+        //were handed out and have since changed
+        disk->pentry_arr_crc = gpt_pentry_track_update(&disk->track,
+                        &disk->view,
+                        &disk->index,
                         disk->pentry_arr,
-                        disk->pentry_arr_size);
-        //Recalculate the CRC of the backup partition array
-        disk->pentry_arr_bak_crc = crc32(0,
+                        disk->pentry_arr_size,
+                        disk->pentry_size,
+                        disk->block_size,
+                        disk->pentry_arr_crc);
+        //Same for the backup partition array
+        disk->pentry_arr_bak_crc = gpt_pentry_track_update(&disk->track_bak,
+                        &disk->view_bak,
+                        &disk->index_bak,
                         disk->pentry_arr_bak,
-                        disk->pentry_arr_size);
+                        disk->pentry_arr_size,
+                        disk->pentry_size,
+                        disk->block_size,
+                        disk->pentry_arr_bak_crc);
         //Update the partition CRC value in the primary GPT header
         PUT_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET, disk->pentry_arr_crc);
         //Update the partition CRC value in the backup GPT header
@@ -1484,8 +3815,8 @@ int gpt_disk_update_crc(struct gpt_disk *disk)
         //Header CRC is calculated with its own CRC field set to 0
         PUT_4_BYTES(disk->hdr + HEADER_CRC_OFFSET, 0);
         PUT_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET, 0);
-        disk->hdr_crc = crc32(0, disk->hdr, gpt_header_size);
-        disk->hdr_bak_crc = crc32(0, disk->hdr_bak, gpt_header_size);
+        disk->hdr_crc = gpt_crc32(0, disk->hdr, gpt_header_size);
+        disk->hdr_bak_crc = gpt_crc32(0, disk->hdr_bak, gpt_header_size);
         PUT_4_BYTES(disk->hdr + HEADER_CRC_OFFSET, disk->hdr_crc);
         PUT_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET, disk->hdr_bak_crc);
         return 0;
@@ -1493,50 +3824,277 @@ error:
         return -1;
 }
 
-//Write the contents of struct gpt_disk back to the actual disk
+//Write the contents of struct gpt_disk back to the actual disk. Only the
+//entry array sectors holding entries changed since the last commit are
+//written. The backup table is written and flushed before the primary
+//one is touched, so a crash leaves at least one consistent table.
 int gpt_disk_commit(struct gpt_disk *disk)
 {
-        int fd = -1;
+        uint64_t start = gpt_stat_start();
+        int lock_fd = -1;
+        ATRACE_BEGIN("gpt-utils: commit");
         if (!disk || (disk->is_initialized != GPT_DISK_INIT_MAGIC)){
                 ALOGE("%s: Invalid args", __func__);
                 goto error;
         }
-        fd = open(disk->devpath, O_RDWR);
-        if (fd < 0) {
-                ALOGE("%s: Failed to open %s: %s",
-                                __func__,
-                                disk->devpath,
-                                strerror(errno));
+        //Other processes must not pick up the tables being replaced
+        lock_fd = gpt_snapshot_lock(LOCK_SH);
+        gpt_snapshot_invalidate();
+        if (disk->direct_fd < 0)
+                disk->direct_fd = blk_open_direct(disk->devpath);
+        //Write back the changed secondary partition array sectors
+        if (gpt_set_pentry_sectors(disk->hdr_bak, disk, disk->pentry_arr_bak,
+                                disk->track_bak.dirty)) {
+                ALOGE("%s: Failed to write secondary GPT partition arr",
+                                __func__);
                 goto error;
         }
-        //Write the primary header
-        if(gpt_set_header(disk->hdr, fd, PRIMARY_GPT) != 0) {
-                ALOGE("%s: Failed to update primary GPT header",
+        //Write back the secondary header
+        if(gpt_set_header(disk->hdr_bak, disk, SECONDARY_GPT) != 0) {
+                ALOGE("%s: Failed to update secondary GPT header",
                                 __func__);
                 goto error;
         }
-        //Write back the primary partition array
-        if (gpt_set_pentry_arr(disk->hdr, fd, disk->pentry_arr)) {
+        if (gpt_fdatasync(disk->fd)) {
+                ALOGE("%s: Failed to flush secondary GPT: %s",
+                                __func__,
+                                strerror(errno));
+                goto error;
+        }
+        //Write back the changed primary partition array sectors
+        if (gpt_set_pentry_sectors(disk->hdr, disk, disk->pentry_arr,
+                                disk->track.dirty)) {
                 ALOGE("%s: Failed to write primary GPT partition arr",
                                 __func__);
                 goto error;
         }
-        //Write back the secondary header
-        if(gpt_set_header(disk->hdr_bak, fd, SECONDARY_GPT) != 0) {
-                ALOGE("%s: Failed to update secondary GPT header",
+        //Write the primary header
+        if(gpt_set_header(disk->hdr, disk, PRIMARY_GPT) != 0) {
+                ALOGE("%s: Failed to update primary GPT header",
                                 __func__);
                 goto error;
         }
-        //Write back the secondary partition array
-        if (gpt_set_pentry_arr(disk->hdr_bak, fd, disk->pentry_arr_bak)) {
-                ALOGE("%s: Failed to write secondary GPT partition arr",
-                                __func__);
+        if (gpt_fdatasync(disk->fd)) {
+                ALOGE("%s: Failed to flush primary GPT: %s",
+                                __func__,
+                                strerror(errno));
                 goto error;
         }
-        close(fd);
+        memset(disk->track.dirty, 0,
+                        DIV_ROUND_UP(DIV_ROUND_UP(disk->pentry_arr_size,
+                                        disk->block_size), 8));
+        memset(disk->track_bak.dirty, 0,
+                        DIV_ROUND_UP(DIV_ROUND_UP(disk->pentry_arr_size,
+                                        disk->block_size), 8));
+        gpt_snapshot_unlock(lock_fd);
+        gpt_stat_add(GPT_STAT_COMMIT, start, 0);
+        ATRACE_END();
         return 0;
 error:
-        if (fd >= 0)
-                close(fd);
+        gpt_snapshot_unlock(lock_fd);
+        gpt_stat_add(GPT_STAT_COMMIT, start, 0);
+        ATRACE_END();
         return -1;
 }
+
+namespace gpt {
+
+const gpt_pentry_view& Entry::View() const
+{
+        return instance_ == PRIMARY_GPT ? disk_->view : disk_->view_bak;
+}
+
+span<const uint8_t> Entry::Raw() const
+{
+        const uint8_t *arr = instance_ == PRIMARY_GPT ?
+                disk_->pentry_arr : disk_->pentry_arr_bak;
+        return { arr + (size_t)index_ * disk_->pentry_size,
+                disk_->pentry_size };
+}
+
+span<const uint8_t, TYPE_GUID_SIZE> Entry::TypeGuid() const
+{
+        return span<const uint8_t, TYPE_GUID_SIZE>(View().type_guid[index_],
+                        TYPE_GUID_SIZE);
+}
+
+uint64_t Entry::FirstLba() const
+{
+        return View().first_lba[index_];
+}
+
+uint64_t Entry::LastLba() const
+{
+        return View().last_lba[index_];
+}
+
+uint64_t Entry::Attributes() const
+{
+        return View().attr[index_];
+}
+
+string_view Entry::Name() const
+{
+        return View().name[index_];
+}
+
+optional<Disk> Disk::Load(const char *partname)
+{
+        Disk disk(gpt_disk_alloc());
+        if (!disk.disk_ || gpt_disk_get_disk_info(partname, disk.Get()))
+                return nullopt;
+        return disk;
+}
+
+span<const uint8_t> Disk::Header(gpt_instance instance) const
+{
+        return { instance == PRIMARY_GPT ? disk_->hdr : disk_->hdr_bak,
+                disk_->block_size };
+}
+
+span<const uint8_t> Disk::Entries(gpt_instance instance) const
+{
+        return { instance == PRIMARY_GPT ?
+                disk_->pentry_arr : disk_->pentry_arr_bak,
+                disk_->pentry_arr_size };
+}
+
+uint32_t Disk::NumEntries(gpt_instance instance) const
+{
+        return instance == PRIMARY_GPT ?
+                disk_->view.num : disk_->view_bak.num;
+}
+
+Entry Disk::At(gpt_instance instance, uint32_t index) const
+{
+        return Entry(disk_.get(), instance, index);
+}
+
+optional<Entry> Disk::Find(gpt_instance instance, string_view name) const
+{
+        //Longer names can't match a narrowed entry name
+        char partname[MAX_GPT_NAME8_SIZE];
+        uint32_t idx;
+        if (name.size() >= sizeof(partname))
+                return nullopt;
+        memcpy(partname, name.data(), name.size());
+        partname[name.size()] = '\0';
+        idx = gpt_disk_seek_pentry(disk_.get(), partname, instance);
+        if (idx == UINT32_MAX)
+                return nullopt;
+        return Entry(disk_.get(), instance, idx);
+}
+
+int Disk::Update(const Entry& entry, uint32_t offset,
+                span<const uint8_t> data)
+{
+        return gpt_disk_update_pentry(disk_.get(), entry.instance_,
+                        entry.Raw().data(), offset, data.data(), data.size());
+}
+
+int Disk::Commit()
+{
+        if (gpt_disk_update_crc(disk_.get()))
+                return -1;
+        return gpt_disk_commit(disk_.get());
+}
+
+}  // namespace gpt
+
+//Apply the slot attribute change to one instance of the entries of the
+//partitions in locs. Returns the number of entries changed or -1.
+static int gpt_disk_set_slot_attributes(gpt::Disk& disk,
+                enum gpt_instance instance,
+                span<const gpt::PartitionMap::Location> locs,
+                const char *slot_suffix,
+                uint8_t flags)
+{
+        uint8_t attr;
+        int changed = 0;
+        for (const gpt::PartitionMap::Location& loc : locs) {
+                optional<gpt::Entry> entry = disk.Find(instance,
+                                loc.partition);
+                if (!entry) {
+                        ALOGE("%s: Failed to find %s", __func__,
+                                        loc.partition.data());
+                        return -1;
+                }
+                attr = entry->Raw()[AB_FLAG_OFFSET];
+                if (!loc.partition.ends_with(slot_suffix))
+                        //Other slot, only here to become inactive
+                        attr &= ~AB_PARTITION_ATTR_SLOT_ACTIVE;
+                else if (flags & AB_PARTITION_ATTR_SLOT_ACTIVE)
+                        //Also resets the priority and the retry count
+                        attr = AB_SLOT_ACTIVE_VAL |
+                                (flags & ~AB_PARTITION_ATTR_SLOT_ACTIVE);
+                else
+                        attr |= flags;
+                if (attr == entry->Raw()[AB_FLAG_OFFSET])
+                        continue;
+                if (disk.Update(*entry, AB_FLAG_OFFSET, { &attr, 1 }))
+                        return -1;
+                changed++;
+        }
+        return changed;
+}
+
+int gpt_utils_set_slot_attributes(unsigned slot, uint8_t flags)
+{
+        static const char *ab_ptn_list[] = { AB_PTN_LIST };
+        const char *suffix[] = { AB_SLOT_A_SUFFIX, AB_SLOT_B_SUFFIX };
+        vector<string> ptn_list;
+        vector<string_view> names;
+        optional<gpt::PartitionMap> pm;
+        int changed;
+        if (slot >= ARRAY_SIZE(suffix) ||
+                        (flags & ~AB_PARTITION_ATTR_SLOT_MASK)) {
+                ALOGE("%s: Invalid argument", __func__);
+                return -1;
+        }
+        for (uint32_t i = 0; i < ARRAY_SIZE(ab_ptn_list); i++) {
+                ptn_list.push_back(string(ab_ptn_list[i]) + suffix[slot]);
+                if (flags & AB_PARTITION_ATTR_SLOT_ACTIVE)
+                        ptn_list.push_back(string(ab_ptn_list[i]) +
+                                        suffix[!slot]);
+        }
+        names.assign(ptn_list.begin(), ptn_list.end());
+        //Group the partitions by the disk holding them
+        pm = gpt::PartitionMap::Build(names);
+        if (!pm) {
+                ALOGE("%s: Failed to get partition map", __func__);
+                return -1;
+        }
+        for (string_view path : pm->Disks()) {
+                span<const gpt::PartitionMap::Location> locs =
+                        pm->OnDisk(path);
+                optional<gpt::Disk> disk =
+                        gpt::Disk::Load(locs[0].partition.data());
+                if (!disk) {
+                        ALOGE("%s: Failed to get disk info for %s",
+                                        __func__,
+                                        path.data());
+                        return -1;
+                }
+                changed = gpt_disk_set_slot_attributes(*disk, PRIMARY_GPT,
+                                locs, suffix[slot], flags);
+                if (changed >= 0) {
+                        int changed_bak = gpt_disk_set_slot_attributes(*disk,
+                                        SECONDARY_GPT, locs,
+                                        suffix[slot], flags);
+                        changed = changed_bak < 0 ? -1 : changed + changed_bak;
+                }
+                if (changed < 0) {
+                        ALOGE("%s: Failed to update entries on %s",
+                                        __func__,
+                                        path.data());
+                        return -1;
+                }
+                if (changed && disk->Commit()) {
+                        ALOGE("%s: Failed to commit %s",
+                                        __func__,
+                                        path.data());
+                        return -1;
+                }
+        }
+        return 0;
+}
@@ -61,6 +61,20 @@ extern "C" {
 #define ATTRIBUTE_FLAG_OFFSET       48
 #define PARTITION_NAME_OFFSET       56
 #define MAX_GPT_NAME_SIZE           72
+//Partition name narrowed from UTF-16 to 8 bit, plus terminator
+#define MAX_GPT_NAME8_SIZE          ((MAX_GPT_NAME_SIZE / 2) + 1)
+
+//Fields reported by gpt_disk_diff_pentries()
+#define GPT_PENTRY_DIFF_TYPE_GUID   (1 << 0)
+#define GPT_PENTRY_DIFF_UNIQUE_GUID (1 << 1)
+//First or last LBA
+#define GPT_PENTRY_DIFF_LBA         (1 << 2)
+#define GPT_PENTRY_DIFF_ATTR        (1 << 3)
+#define GPT_PENTRY_DIFF_NAME        (1 << 4)
+//Bytes past the name, in entries larger than PTN_ENTRY_SIZE
+#define GPT_PENTRY_DIFF_OTHER       (1 << 5)
+//Entry used in one table only, which has more entries than the other
+#define GPT_PENTRY_DIFF_MISSING     (1 << 6)
 
 /******************************************************************************
  * AB RELATED DEFINES
@@ -72,6 +86,10 @@ extern "C" {
 #define AB_PARTITION_ATTR_SLOT_ACTIVE (0x1<<2)
 #define AB_PARTITION_ATTR_BOOT_SUCCESSFUL (0x1<<6)
 #define AB_PARTITION_ATTR_UNBOOTABLE (0x1<<7)
+//Attribute bits managed by gpt_utils_set_slot_attributes()
+#define AB_PARTITION_ATTR_SLOT_MASK (AB_PARTITION_ATTR_SLOT_ACTIVE | \
+		AB_PARTITION_ATTR_BOOT_SUCCESSFUL | \
+		AB_PARTITION_ATTR_UNBOOTABLE)
 #define AB_SLOT_ACTIVE_VAL              0x3F
 #define AB_SLOT_INACTIVE_VAL            0x0
 #define AB_SLOT_ACTIVE                  1
@@ -107,6 +125,56 @@ enum boot_chain {
 	BACKUP_BOOT
 };
 
+//CRC bookkeeping for the entries of one partition entry array that callers
+//may have modified, through the pointers returned by gpt_disk_get_pentry()
+//or with gpt_disk_update_pentry(). Lets gpt_disk_update_crc() patch the
+//array CRC for just those entries instead of re-hashing the whole array,
+//and gpt_disk_commit() write only the sectors holding changed entries.
+struct gpt_pentry_track {
+	//CRC of each entry as of the last CRC update, valid for tracked entries
+	uint32_t *crc;
+	//Indices of the tracked entries
+	uint32_t *idx;
+	//Bitmap of tracked entry indices
+	uint8_t *map;
+	//Bitmap of the array's disk sectors changed since the last commit
+	uint8_t *dirty;
+	//Number of valid elements in idx
+	uint32_t num;
+};
+
+//Name lookup index over one partition entry array, built when the disk is
+//loaded. Entries renamed with gpt_disk_update_pentry() move to their new
+//name at once, those renamed through gpt_disk_get_pentry() pointers on the
+//next gpt_disk_update_crc().
+struct gpt_pentry_index {
+	//Narrowed name of each entry
+	char (*name)[MAX_GPT_NAME8_SIZE];
+	//Open addressing hash table holding entry index + 1, 0 if free
+	uint32_t *slot;
+	//Next entry with the same name, UINT32_MAX terminated
+	uint32_t *next;
+	//Number of slots in the hash table, a power of two
+	uint32_t num_slots;
+	//Number of entries in the array
+	uint32_t num_entries;
+};
+
+//Decoded fields of the entries of one partition entry array, one array per
+//field in entry order. Built when the disk is loaded and kept in sync by
+//gpt_disk_update_pentry() and gpt_disk_update_crc().
+struct gpt_pentry_view {
+	uint64_t *first_lba;
+	uint64_t *last_lba;
+	//Attribute flags, AB_FLAG_OFFSET byte included
+	uint64_t *attr;
+	uint8_t (*type_guid)[TYPE_GUID_SIZE];
+	//Narrowed names, shared with the name index of the array
+	const char (*name)[MAX_GPT_NAME8_SIZE];
+	//Number of entries in the array
+	uint32_t num;
+};
+
 struct gpt_disk {
 	//GPT primary header
 	uint8_t *hdr;
@@ -130,9 +198,70 @@ struct gpt_disk {
 	uint32_t pentry_arr_bak_crc;
 	//Path to block dev representing the disk
 	char devpath[PATH_MAX];
+	//Descriptor of devpath, open from gpt_disk_get_disk_info() until
+	//gpt_disk_free()
+	int fd;
+	//Descriptor of devpath opened with O_DIRECT by the first
+	//gpt_disk_commit() when the backend asks for direct_io, -1 otherwise
+	int direct_fd;
+	//Size of the disk in bytes
+	uint64_t dev_size;
 	//Block size of disk
 	uint32_t block_size;
 	uint32_t is_initialized;
+	//Entries of pentry_arr/pentry_arr_bak handed out to callers
+	struct gpt_pentry_track track;
+	struct gpt_pentry_track track_bak;
+	//Name index of pentry_arr/pentry_arr_bak
+	struct gpt_pentry_index index;
+	struct gpt_pentry_index index_bak;
+	//Decoded view of pentry_arr/pentry_arr_bak
+	struct gpt_pentry_view view;
+	struct gpt_pentry_view view_bak;
+};
+
+//Entry that differs between the primary and backup partition entry arrays
+struct gpt_pentry_diff {
+	//Index of the entry in both arrays
+	uint32_t index;
+	//GPT_PENTRY_DIFF_* fields that differ
+	uint32_t fields;
+};
+
+//Where the library finds its disks. By default these are the device's
+//block devices; an image backend runs the same code against regular files,
+//eg: to exercise the library on a host.
+struct gpt_utils_backend {
+	//Directory holding one symlink per partition (BOOT_DEV_DIR)
+	const char *by_name_dir;
+	//Disk holding the GPT on eMMC layouts
+	const char *emmc_disk;
+	//1 for UFS (one disk per LUN), 0 for eMMC, -1 to go by
+	//ro.boot.bootdevice
+	int is_ufs;
+	//Sector size of disks that are regular files, 0 for 512
+	uint32_t image_block_size;
+	//Non zero if the by-name links point at the disk (eg: a LUN image)
+	//rather than at a partition node of a /dev/block/sdX disk. Relative
+	//links are taken relative to by_name_dir.
+	int links_to_disks;
+	//File on tmpfs through which processes share the partition tables
+	//and links they read during a boot, NULL to not share them (the
+	//default). Tables found in it are used without reading the disk, and
+	//GPT updates made through the library drop it, so only set this where
+	//nothing else writes GPTs until the next boot.
+	const char *snapshot_path;
+	//Non zero to write GPTs with O_DIRECT instead of through the page
+	//cache. Writes fall back to the page cache where the disk does not
+	//support direct I/O or the write is not block aligned.
+	int direct_io;
+	//Directory with the sysfs nodes of the disks, where the scsi generic
+	//node of a LUN is looked up, and directory holding the scsi generic
+	//nodes. NULL for /sys/block and /dev. A scsi generic node that is a
+	//regular file stands in for the UFS device: byte n of it holds
+	//device attribute n.
+	const char *sysfs_block_dir;
+	const char *sg_dev_dir;
 };
 
 /******************************************************************************
@@ -144,23 +273,102 @@ struct gpt_disk* gpt_disk_alloc();
 //Free previously allocated gpt_disk struct
 void gpt_disk_free(struct gpt_disk *disk);
 //Get the details of the disk holding the partition whose name
-//is passed in via dev
+//is passed in via dev. The disk stays open until gpt_disk_free(), and
+//the handle may be reused for another disk.
 int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *disk);
 
-//Get pointer to partition entry from a allocated gpt_disk structure
+//Get pointer to partition entry from a allocated gpt_disk structure.
+//The caller may modify the entry through it.
 uint8_t* gpt_disk_get_pentry(struct gpt_disk *disk,
 		const char *partname,
 		enum gpt_instance instance);
 
-//Update the crc fields of the modified disk structure
+//Get read only pointer to partition entry from a allocated gpt_disk
+//structure
+const uint8_t* gpt_disk_find_pentry(struct gpt_disk *disk,
+		const char *partname,
+		enum gpt_instance instance);
+
+//Overwrite len bytes at offset within pentry, an entry of the given
+//instance of the disk (eg: as returned by gpt_disk_find_pentry()).
+//Preferred over writing through gpt_disk_get_pentry() pointers.
+int gpt_disk_update_pentry(struct gpt_disk *disk,
+		enum gpt_instance instance,
+		const uint8_t *pentry,
+		uint32_t offset,
+		const void *data,
+		uint32_t len);
+
+//Decoded view of the given instance's partition entries. Changes made
+//through gpt_disk_get_pentry() pointers show up after gpt_disk_update_crc().
+const struct gpt_pentry_view* gpt_disk_get_view(struct gpt_disk *disk,
+		enum gpt_instance instance);
+
+//Compare the primary and backup partition entry arrays of the disk, eg: to
+//see how they differ between UPDATE_MAIN and UPDATE_FINALIZE. The first
+//max_diffs differing entries are stored in diffs, in index order. Returns
+//the number of differing entries, which may exceed max_diffs, or -1 on
+//error.
+int gpt_disk_diff_pentries(struct gpt_disk *disk,
+		struct gpt_pentry_diff *diffs,
+		uint32_t max_diffs);
+
+//Update the crc fields of the modified disk structure. Only the entries
+//returned by gpt_disk_get_pentry() or changed by gpt_disk_update_pentry()
+//are re-hashed, so entries must not be modified through any other pointer.
 int gpt_disk_update_crc(struct gpt_disk *disk);
 
-//Write the contents of struct gpt_disk back to the actual disk
+//Write the contents of struct gpt_disk back to the actual disk. Only the
+//headers and the sectors of entries changed since the last commit are
+//written, so gpt_disk_update_crc() must be called first.
 int gpt_disk_commit(struct gpt_disk *disk);
 
+//Set the A/B attribute bits in flags (within AB_PARTITION_ATTR_SLOT_MASK)
+//on every AB_PTN_LIST partition of slot (0 for _a, 1 for _b), in both GPT
+//instances. Other attribute bits are left as they are, except that
+//AB_PARTITION_ATTR_SLOT_ACTIVE writes AB_SLOT_ACTIVE_VAL like the boot
+//control HAL does: highest priority, full retry count, and the successful
+//and unbootable bits cleared. It also clears SLOT_ACTIVE on the other
+//slot. Each disk holding such partitions is loaded once and committed at
+//most once, and only if something changed.
+int gpt_utils_set_slot_attributes(unsigned slot, uint8_t flags);
+
 //Return if the current device is UFS based or not
 int gpt_utils_is_ufs_device();
 
+//The storage type, the disk behind each by-name link and the scsi generic
+//node of the boot LUNs are looked up once and cached. The cached links are
+//dropped whenever the by-name directory changes; this drops everything,
+//eg: after the device's storage was rescanned in a way that isn't visible
+//there.
+void gpt_utils_reset_topology();
+
+//Wait until the by-name links of all count partitions in partnames exist,
+//eg: for bootctrl early in boot before ueventd has created all of them.
+//Waits on inotify events of the by-name directory (or of the directories
+//above it until it exists) rather than polling. timeout_ms < 0 waits
+//forever. Returns 0 once all links exist, -1 with errno ETIMEDOUT if some
+//are still missing at the deadline, or -1 on other errors.
+int gpt_utils_wait_for_partitions(const char * const *partnames,
+		uint32_t count,
+		int timeout_ms);
+
+//Write the library's counters to fd as text: for reads, writes,
+//fsyncs, CRCs, symlink resolutions, ioctls, prepare_partitions() and
+//gpt_disk_commit() calls, their number and bytes. For the calls made while
+//the HAL trace category was enabled, or timing was turned on, also their
+//number, total time and a latency histogram. Meant for HAL debug dumps.
+//Returns 0 on success.
+int gpt_utils_dump_stats(int fd);
+
+//Time every counted call, not only the ones made while tracing
+void gpt_utils_set_stats_timing(int enable);
+
+//Select the backend used by all other calls, or restore the default
+//block device backend if backend is NULL. Not thread safe; call it before
+//anything else.
+int gpt_utils_set_backend(const struct gpt_utils_backend *backend);
+
 //Swtich betwieen using either the primary or the backup
 //boot LUN for boot. This is required since UFS boot partitions
 //cannot have a backup GPT which is what we use for failsafe
@@ -184,7 +392,8 @@ int gpt_utils_set_xbl_boot_partition(enum boot_chain chain);
 //populate the map to indicate which physical disk each of the partitions
 //sits on. The key in the map is the path to the block device where the
 //partiton lies and the value is a vector of strings indicating which of
-//the passed in partiton names sits on that device.
+//the passed in partiton names sits on that device. gpt::PartitionMap in
+//gpt.h does the same without copying the names.
 int gpt_utils_get_partition_map(std::vector<std::string>& partition_list,
                 std::map<std::string,std::vector<std::string>>& partition_map);
 #ifdef __cplusplus
@@ -0,0 +1,124 @@
+/*
+ * SPDX-FileCopyrightText: 2024 The LineageOS Project
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//C++ interface to the partition tables, over the gpt_disk functions of
+//gpt-utils.h. Disk owns a loaded disk and hands out views into its tables
+//instead of copies.
+
+#pragma once
+
+#include <limits.h>
+#include <stdint.h>
+
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "gpt-utils.h"
+
+namespace gpt {
+
+//Partition entry of a loaded Disk. Reads the disk's tables on each call, so
+//it sees later updates, and is only valid as long as the Disk.
+class Entry {
+  public:
+    uint32_t Index() const { return index_; }
+    //Entry as stored on disk, pentry_size bytes
+    std::span<const uint8_t> Raw() const;
+    std::span<const uint8_t, TYPE_GUID_SIZE> TypeGuid() const;
+    uint64_t FirstLba() const;
+    uint64_t LastLba() const;
+    //Attribute flags, AB_FLAG_OFFSET byte included
+    uint64_t Attributes() const;
+    //Narrowed name
+    std::string_view Name() const;
+
+  private:
+    friend class Disk;
+    Entry(const gpt_disk* disk, gpt_instance instance, uint32_t index)
+        : disk_(disk), instance_(instance), index_(index) {}
+
+    const gpt_pentry_view& View() const;
+
+    const gpt_disk* disk_;
+    gpt_instance instance_;
+    uint32_t index_;
+};
+
+//Partition tables of one disk, loaded once and kept open until the Disk
+//is destroyed. Move-only.
+class Disk {
+  public:
+    //Loads the disk holding the partition partname
+    static std::optional<Disk> Load(const char* partname);
+
+    Disk(Disk&&) = default;
+    Disk& operator=(Disk&&) = default;
+    Disk(const Disk&) = delete;
+    Disk& operator=(const Disk&) = delete;
+
+    std::string_view Path() const { return disk_->devpath; }
+    uint32_t BlockSize() const { return disk_->block_size; }
+    //Header of the given instance, one block
+    std::span<const uint8_t> Header(gpt_instance instance) const;
+    //Partition entry array of the given instance
+    std::span<const uint8_t> Entries(gpt_instance instance) const;
+    uint32_t NumEntries(gpt_instance instance) const;
+    //Entry index of the given instance, index < NumEntries(instance)
+    Entry At(gpt_instance instance, uint32_t index) const;
+    //First entry named name, or its name-bak twin
+    std::optional<Entry> Find(gpt_instance instance, std::string_view name) const;
+
+    //Overwrites data.size() bytes at offset within entry, see
+    //gpt_disk_update_pentry()
+    int Update(const Entry& entry, uint32_t offset, std::span<const uint8_t> data);
+    //Updates the CRCs and writes the changed entries and the headers
+    int Commit();
+
+    //For the gpt_disk functions that have no counterpart here
+    gpt_disk* Get() const { return disk_.get(); }
+
+  private:
+    struct Deleter {
+        void operator()(gpt_disk* disk) const { gpt_disk_free(disk); }
+    };
+
+    explicit Disk(gpt_disk* disk) : disk_(disk) {}
+
+    std::unique_ptr<gpt_disk, Deleter> disk_;
+};
+
+//Disk holding each of a list of partitions, as one flat vector sorted by
+//disk. Partitions on the same disk keep the order of the list. The views
+//are NUL terminated and point into the library's cached disk map, which
+//the PartitionMap keeps alive, so nothing is copied per partition.
+class PartitionMap {
+  public:
+    struct Location {
+        std::string_view disk;
+        std::string_view partition;
+    };
+
+    //Partitions without a by-name link are left out. Fails if partitions
+    //is empty.
+    static std::optional<PartitionMap> Build(std::span<const std::string_view> partitions);
+
+    std::span<const Location> Locations() const { return locations_; }
+    //Locations on disk, in the order of the list
+    std::span<const Location> OnDisk(std::string_view disk) const;
+    //Disks holding any of the partitions, in sorted order
+    std::vector<std::string_view> Disks() const;
+
+  private:
+    PartitionMap() = default;
+
+    //Owner of the strings the views point into
+    std::shared_ptr<const void> storage_;
+    std::vector<Location> locations_;
+};
+
+}  // namespace gpt
@@ -43,10 +43,24 @@
  */
 
 /* Code taken from FreeBSD 8 */
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-static uint32_t crc32_tab[] = {
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_PCLMUL 1
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32_HAVE_ARMV8 1
+#endif
+
+#include "sparse_crc32.h"
+
+static constexpr uint32_t crc32_tab[] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f, 0xe963a535, 0x9e6495a3,
     0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988, 0x09b64c2b, 0x7eb17cbd, 0xe7b82d07, 0x90bf1d91,
     0x1db71064, 0x6ab020f2, 0xf3b97148, 0x84be41de, 0x1adad47d, 0x6ddde4eb, 0xf4d4b551, 0x83d385c7,
@@ -80,18 +94,326 @@ static uint32_t crc32_tab[] = {
     0xbdbdf21c, 0xcabac28a, 0x53b39330, 0x24b4a3a6, 0xbad03605, 0xcdd70693, 0x54de5729, 0x23d967bf,
     0xb3667a2e, 0xc4614ab8, 0x5d681b02, 0x2a6f2b94, 0xb40bbe37, 0xc30c8ea1, 0x5a05df1b, 0x2d02ef8d};
 
+
 /*
- * A function that calculates the CRC-32 based on the table above is
- * given below for documentation purposes. An equivalent implementation
- * of this function that's actually used in the kernel can be found
- * in sys/libkern.h, where it can be inlined.
+ * Slicing-by-8 tables: crc32_slice[k][b] is the CRC register after feeding
+ * byte b followed by k zero bytes. Row 0 is crc32_tab itself. This lets the
+ * portable path consume 8 bytes per iteration with 8 independent lookups
+ * instead of a serial chain of 8 table lookups.
  */
+struct crc32_slice_tab {
+  uint32_t t[8][256];
+};
 
-uint32_t sparse_crc32(uint32_t crc_in, const void* buf, size_t size) {
-  const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
-  uint32_t crc;
+static constexpr crc32_slice_tab crc32_make_slice_tab() {
+  crc32_slice_tab s = {};
+  for (int b = 0; b < 256; b++) s.t[0][b] = crc32_tab[b];
+  for (int k = 1; k < 8; k++)
+    for (int b = 0; b < 256; b++)
+      s.t[k][b] = (s.t[k - 1][b] >> 8) ^ crc32_tab[s.t[k - 1][b] & 0xFF];
+  return s;
+}
+
+static constexpr crc32_slice_tab crc32_slice = crc32_make_slice_tab();
 
-  crc = crc_in ^ ~0U;
+/*
+ * All kernels below work on the raw (pre-inverted) CRC register; the
+ * ~0 pre and post conditioning is applied once in sparse_crc32().
+ */
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t* p, size_t size) {
   while (size--) crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-  return crc ^ ~0U;
+  return crc;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t* p, size_t size) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (size && ((uintptr_t)p & 7)) {
+    crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    size--;
+  }
+  while (size >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = crc32_slice.t[7][lo & 0xFF] ^ crc32_slice.t[6][(lo >> 8) & 0xFF] ^
+          crc32_slice.t[5][(lo >> 16) & 0xFF] ^ crc32_slice.t[4][lo >> 24] ^
+          crc32_slice.t[3][hi & 0xFF] ^ crc32_slice.t[2][(hi >> 8) & 0xFF] ^
+          crc32_slice.t[1][(hi >> 16) & 0xFF] ^ crc32_slice.t[0][hi >> 24];
+    p += 8;
+    size -= 8;
+  }
+#endif
+  return crc32_bytewise(crc, p, size);
+}
+
+#if defined(CRC32_HAVE_PCLMUL)
+/*
+ * Carry-less multiply folding, after "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). Folds 4x128 bits
+ * per iteration and Barrett-reduces the remainder; constants are for the
+ * bit-reflected 0xedb88320 polynomial. Requires size >= 64 and a multiple
+ * of 16; the caller handles the tail.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul_fold(uint32_t crc, const uint8_t* p, size_t size) {
+  alignas(16) static const uint64_t k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const uint64_t k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const uint64_t k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const uint64_t poly[] = {0x01db710641, 0x01f7011641};
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+  x0 = _mm_load_si128((const __m128i*)k1k2);
+  p += 64;
+  size -= 64;
+
+  while (size >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(p + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(p + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(p + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(p + 0x30)));
+    p += 64;
+    size -= 64;
+  }
+
+  /* Fold the four lanes into one */
+  x0 = _mm_load_si128((const __m128i*)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (size >= 16) {
+    x2 = _mm_loadu_si128((const __m128i*)p);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    p += 16;
+    size -= 16;
+  }
+
+  /* 128 -> 64 bits */
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0 = _mm_load_si128((const __m128i*)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32_pclmul(uint32_t crc, const uint8_t* p, size_t size) {
+  size_t bulk = size & ~(size_t)15;
+
+  if (bulk < 64) return crc32_slice8(crc, p, size);
+  crc = crc32_pclmul_fold(crc, p, bulk);
+  return crc32_slice8(crc, p + bulk, size - bulk);
+}
+#endif
+
+#if defined(CRC32_HAVE_ARMV8)
+/*
+ * ARMv8 CRC32 instructions implement exactly this (reflected 0x04c11db7)
+ * polynomial, so each 64-bit word is a single crc32x.
+ */
+__attribute__((target("crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t* p, size_t size) {
+  while (size && ((uintptr_t)p & 7)) {
+    crc = __crc32b(crc, *p++);
+    size--;
+  }
+  while (size >= 32) {
+    uint64_t w[4];
+    memcpy(w, p, sizeof(w));
+    crc = __crc32d(crc, w[0]);
+    crc = __crc32d(crc, w[1]);
+    crc = __crc32d(crc, w[2]);
+    crc = __crc32d(crc, w[3]);
+    p += 32;
+    size -= 32;
+  }
+  while (size >= 8) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    crc = __crc32d(crc, w);
+    p += 8;
+    size -= 8;
+  }
+  while (size--) crc = __crc32b(crc, *p++);
+  return crc;
+}
+#endif
+
+typedef uint32_t (*crc32_kernel_t)(uint32_t, const uint8_t*, size_t);
+
+static crc32_kernel_t crc32_select_kernel() {
+#if defined(CRC32_HAVE_PCLMUL)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) return crc32_pclmul;
+#elif defined(CRC32_HAVE_ARMV8)
+  if (getauxval(AT_HWCAP) & HWCAP_CRC32) return crc32_armv8;
+#endif
+  return crc32_slice8;
+}
+
+static bool crc32_portable_only;
+
+void sparse_crc32_force_portable(int enable) {
+  crc32_portable_only = enable;
+}
+
+/*
+ * zlib compatible CRC-32: sparse_crc32(0, buf, size) == crc32(0, buf, size),
+ * and calls can be chained by passing the previous result as crc_in. The
+ * fastest kernel the CPU supports is picked on first use.
+ */
+uint32_t sparse_crc32(uint32_t crc_in, const void* buf, size_t size) {
+  static const crc32_kernel_t kernel = crc32_select_kernel();
+  crc32_kernel_t k = crc32_portable_only ? crc32_slice8 : kernel;
+
+  return k(crc_in ^ ~0U, reinterpret_cast<const uint8_t*>(buf), size) ^ ~0U;
+}
+
+/*
+ * GF(2) arithmetic modulo the CRC polynomial, in the same bit-reflected
+ * representation as the CRC register (x^0 is the MSB). Used to advance a
+ * CRC over len zero bytes in O(log len), as in zlib's crc32_combine().
+ */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+  uint32_t m = 1U << 31;
+  uint32_t p = 0;
+
+  /* a must be non-zero */
+  for (;;) {
+    if (a & m) {
+      p ^= b;
+      if ((a & (m - 1)) == 0) break;
+    }
+    m >>= 1;
+    b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+  }
+  return p;
+}
+
+struct crc32_x2n_tab {
+  /* t[k] = x^(2^k) mod p(x) */
+  uint32_t t[32];
+};
+
+static constexpr crc32_x2n_tab crc32_make_x2n_tab() {
+  crc32_x2n_tab x = {};
+  uint32_t p = 1U << 30; /* x^1 */
+
+  x.t[0] = p;
+  for (int k = 1; k < 32; k++) {
+    /* constexpr copy of crc32_multmodp(p, p) */
+    uint32_t m = 1U << 31, r = 0, b = p;
+    for (;;) {
+      if (p & m) {
+        r ^= b;
+        if ((p & (m - 1)) == 0) break;
+      }
+      m >>= 1;
+      b = b & 1 ? (b >> 1) ^ 0xedb88320 : b >> 1;
+    }
+    x.t[k] = p = r;
+  }
+  return x;
+}
+
+static constexpr crc32_x2n_tab crc32_x2n = crc32_make_x2n_tab();
+
+/* x^(n * 2^k) mod p(x) */
+static uint32_t crc32_x2nmodp(uint64_t n, unsigned k) {
+  uint32_t p = 1U << 31; /* x^0 */
+
+  while (n) {
+    if (n & 1) p = crc32_multmodp(crc32_x2n.t[k & 31], p);
+    n >>= 1;
+    k++;
+  }
+  return p;
+}
+
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2) {
+  return crc32_multmodp(crc32_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+uint32_t sparse_crc32_zeros(uint32_t crc, uint64_t len) {
+  /* Zero bytes only shift the register */
+  return crc32_multmodp(crc32_x2nmodp(len, 3), crc ^ ~0U) ^ ~0U;
+}
+
+uint32_t sparse_crc32_fill(uint32_t crc, uint32_t fill, uint64_t len) {
+  const uint8_t* pattern = reinterpret_cast<const uint8_t*>(&fill);
+  uint64_t n = len / 4;
+  uint32_t reg = crc ^ ~0U;
+  /* Shift and register contribution of 2^k patterns, starting with k = 0 */
+  uint32_t shift = crc32_x2n.t[5];
+  uint32_t add = crc32_bytewise(0, pattern, 4);
+
+  if (fill == 0) return sparse_crc32_zeros(crc, len);
+
+  /*
+   * All runs are copies of the same pattern, so the runs making up n can
+   * be applied in any order.
+   */
+  while (n) {
+    if (n & 1) reg = crc32_multmodp(shift, reg) ^ add;
+    n >>= 1;
+    if (n) {
+      add ^= crc32_multmodp(shift, add);
+      shift = crc32_multmodp(shift, shift);
+    }
+  }
+  return crc32_bytewise(reg, pattern, len % 4) ^ ~0U;
+}
+
+uint32_t sparse_crc32_chunks(uint32_t crc, const struct sparse_crc32_chunk* chunks,
+                             size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    switch (chunks[i].type) {
+      case SPARSE_CRC32_CHUNK_RAW:
+        crc = sparse_crc32(crc, chunks[i].data, chunks[i].len);
+        break;
+      case SPARSE_CRC32_CHUNK_FILL:
+        crc = sparse_crc32_fill(crc, chunks[i].fill, chunks[i].len);
+        break;
+      case SPARSE_CRC32_CHUNK_DONT_CARE:
+        crc = sparse_crc32_zeros(crc, chunks[i].len);
+        break;
+      default:
+        break;
+    }
+  }
+  return crc;
 }
@@ -17,8 +17,56 @@
 #ifndef _LIBSPARSE_SPARSE_CRC32_H_
 #define _LIBSPARSE_SPARSE_CRC32_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 uint32_t sparse_crc32(uint32_t crc, const void* buf, size_t size);
 
+/*
+ * Make sparse_crc32() use the portable slice-by-8 kernel (enable != 0) or
+ * the one picked for the CPU again (enable == 0). For tests and benchmarks
+ * of the portable kernel on CPUs with CRC instructions; not thread safe.
+ */
+void sparse_crc32_force_portable(int enable);
+
+/*
+ * Returns the CRC of A || B given crc1 = CRC(A), crc2 = CRC(B) and the
+ * length of B, in O(log len2). Since the CRC is affine, passing
+ * crc1 = CRC(X) ^ CRC(Y) for two equally sized blocks X and Y also gives
+ * the CRC change caused by replacing X with Y len2 bytes before the end
+ * of a buffer.
+ */
+uint32_t sparse_crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+
+/*
+ * Continue crc over len zero bytes, or over len bytes repeating the 4 bytes
+ * of fill as stored in memory, in O(log len).
+ */
+uint32_t sparse_crc32_zeros(uint32_t crc, uint64_t len);
+uint32_t sparse_crc32_fill(uint32_t crc, uint32_t fill, uint64_t len);
+
+/* Same values as the sparse image format chunk types */
+#define SPARSE_CRC32_CHUNK_RAW 0xCAC1
+#define SPARSE_CRC32_CHUNK_FILL 0xCAC2
+#define SPARSE_CRC32_CHUNK_DONT_CARE 0xCAC3
+
+/*
+ * Expanded content of one chunk of a sparse image: len bytes of data, of
+ * fill repeated, or of zeros for DONT_CARE. Other chunk types are skipped.
+ */
+struct sparse_crc32_chunk {
+  uint16_t type;
+  uint32_t fill;
+  const void* data;
+  uint64_t len;
+};
+
+/*
+ * Continue crc over the expanded content of count chunks, in time
+ * proportional to the RAW data only. Feeding an image in several calls
+ * gives the same result as one call with all its chunks.
+ */
+uint32_t sparse_crc32_chunks(uint32_t crc, const struct sparse_crc32_chunk* chunks,
+                             size_t count);
+
 #endif
@@ -0,0 +1,194 @@
+/*
+ * SPDX-FileCopyrightText: 2024 The LineageOS Project
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//Synthetic disks for the image backend of gpt-utils, shared by its tests
+//and benchmarks: GPT disk images, their by-name links and regular files
+//standing in for the scsi generic nodes of UFS LUNs.
+
+#pragma once
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "gpt-utils.h"
+#include "sparse_crc32.h"
+
+namespace gpt_test {
+
+//Partition type of the entries, basic data
+static const uint8_t kTypeGuid[TYPE_GUID_SIZE] = {
+    0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44,
+    0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7,
+};
+
+static inline void Put32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+static inline void Put64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+
+//A GPT disk image: both headers, both entry arrays of num_entries entries
+//and part_blocks blocks per partition, in the order of partitions.
+static inline std::vector<uint8_t> MakeGptImage(uint32_t block_size,
+                                                const std::vector<std::string>& partitions,
+                                                uint32_t num_entries = 128,
+                                                uint32_t part_blocks = 8) {
+    uint64_t arr_blocks = ((uint64_t)num_entries * PTN_ENTRY_SIZE + block_size - 1) / block_size;
+    uint64_t total = 2 + 2 * arr_blocks + partitions.size() * part_blocks + 1;
+    uint64_t first_usable = 2 + arr_blocks;
+    uint64_t bak_arr_lba = total - 1 - arr_blocks;
+    std::vector<uint8_t> img(total * block_size);
+    std::vector<uint8_t> arr(arr_blocks * block_size);
+    uint64_t lba = first_usable;
+
+    for (size_t i = 0; i < partitions.size() && i < num_entries; i++) {
+        uint8_t* e = &arr[i * PTN_ENTRY_SIZE];
+        memcpy(e + TYPE_GUID_OFFSET, kTypeGuid, TYPE_GUID_SIZE);
+        Put64(e + UNIQUE_GUID_OFFSET, i + 1);
+        Put64(e + FIRST_LBA_OFFSET, lba);
+        Put64(e + LAST_LBA_OFFSET, lba + part_blocks - 1);
+        for (size_t c = 0; c < partitions[i].size() && c < MAX_GPT_NAME_SIZE / 2; c++)
+            e[PARTITION_NAME_OFFSET + 2 * c] = partitions[i][c];
+        lba += part_blocks;
+    }
+    uint32_t arr_crc = sparse_crc32(0, arr.data(), (size_t)num_entries * PTN_ENTRY_SIZE);
+
+    auto header = [&](uint64_t my_lba, uint64_t alt_lba, uint64_t arr_lba) {
+        uint8_t* h = &img[my_lba * block_size];
+        memcpy(h, GPT_SIGNATURE, 8);
+        Put32(h + 8, 0x10000);
+        Put32(h + HEADER_SIZE_OFFSET, 92);
+        Put64(h + PRIMARY_HEADER_OFFSET, my_lba);
+        Put64(h + BACKUP_HEADER_OFFSET, alt_lba);
+        Put64(h + FIRST_USABLE_LBA_OFFSET, first_usable);
+        Put64(h + LAST_USABLE_LBA_OFFSET, bak_arr_lba - 1);
+        Put64(h + 56, 7);
+        Put64(h + PENTRIES_OFFSET, arr_lba);
+        Put32(h + PARTITION_COUNT_OFFSET, num_entries);
+        Put32(h + PENTRY_SIZE_OFFSET, PTN_ENTRY_SIZE);
+        Put32(h + PARTITION_CRC_OFFSET, arr_crc);
+        Put32(h + HEADER_CRC_OFFSET, sparse_crc32(0, h, 92));
+        memcpy(&img[arr_lba * block_size], arr.data(), arr.size());
+    };
+    header(1, total - 1, 2);
+    header(total - 1, 1, bak_arr_lba);
+    return img;
+}
+
+static inline bool WriteFile(const std::string& path, const std::vector<uint8_t>& data) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+    bool ok = pwrite(fd, data.data(), data.size(), 0) == (ssize_t)data.size();
+    close(fd);
+    return ok;
+}
+
+static inline std::vector<uint8_t> ReadFile(const std::string& path) {
+    std::vector<uint8_t> data(std::filesystem::file_size(path));
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (pread(fd, data.data(), data.size(), 0) != (ssize_t)data.size()) data.clear();
+        close(fd);
+    }
+    return data;
+}
+
+//Temporary directory holding disk images named after the disks they stand
+//for (eg: sda), a by-name directory linking to them and stub sysfs and
+//scsi generic nodes. Removed with the object.
+class ImageDir {
+  public:
+    ImageDir() {
+        const char* tmp = getenv("TMPDIR");
+#ifdef __ANDROID__
+        if (!tmp) tmp = "/data/local/tmp";
+#else
+        if (!tmp) tmp = "/tmp";
+#endif
+        std::string templ = std::string(tmp) + "/gpt-utils.XXXXXX";
+        if (mkdtemp(templ.data())) {
+            path_ = templ;
+            std::filesystem::create_directory(ByName());
+            std::filesystem::create_directory(path_ + "/sys");
+            std::filesystem::create_directory(path_ + "/dev");
+        }
+    }
+    ~ImageDir() {
+        std::error_code ec;
+        if (!path_.empty()) std::filesystem::remove_all(path_, ec);
+    }
+    ImageDir(const ImageDir&) = delete;
+    ImageDir& operator=(const ImageDir&) = delete;
+
+    bool ok() const { return !path_.empty(); }
+    const std::string& path() const { return path_; }
+    std::string ByName() const { return path_ + "/by-name"; }
+    std::string Disk(const std::string& disk) const { return path_ + "/" + disk; }
+    std::string SgNode(const std::string& sg) const { return path_ + "/dev/" + sg; }
+
+    //Writes disk, see MakeGptImage(), and a by-name link to it for each
+    //of its partitions
+    bool AddDisk(const std::string& disk, uint32_t block_size,
+                 const std::vector<std::string>& partitions, uint32_t num_entries = 128,
+                 uint32_t part_blocks = 8) {
+        if (!WriteFile(Disk(disk),
+                       MakeGptImage(block_size, partitions, num_entries, part_blocks)))
+            return false;
+        for (const std::string& name : partitions)
+            if (symlink(("../" + disk).c_str(), (ByName() + "/" + name).c_str())) return false;
+        return true;
+    }
+
+    //Makes sg the scsi generic node of disk. The node is a regular file
+    //whose byte n holds UFS device attribute n, boot_lun for
+    //QUERY_ATTR_IDN_BOOT_LU_EN.
+    bool AddSgNode(const std::string& disk, const std::string& sg, uint8_t boot_lun = 0) {
+        std::vector<uint8_t> attrs(32);
+        attrs[0] = boot_lun;
+        std::error_code ec;
+        std::filesystem::create_directories(
+                path_ + "/sys/" + disk + "/device/scsi_generic/" + sg, ec);
+        return !ec && WriteFile(SgNode(sg), attrs);
+    }
+
+    //Backend over the directory. eMMC layouts keep their partitions on
+    //emmc_disk. Tables are shared through the file snapshot in the
+    //directory, if given.
+    gpt_utils_backend Backend(bool ufs, uint32_t block_size,
+                              const std::string& emmc_disk = "",
+                              const char* snapshot = nullptr) {
+        by_name_ = ByName();
+        emmc_ = emmc_disk.empty() ? Disk("none") : Disk(emmc_disk);
+        sys_ = path_ + "/sys";
+        dev_ = path_ + "/dev";
+        snapshot_ = snapshot ? path_ + "/" + snapshot : "";
+        gpt_utils_backend b = {};
+        b.by_name_dir = by_name_.c_str();
+        b.emmc_disk = emmc_.c_str();
+        b.is_ufs = ufs;
+        b.image_block_size = block_size;
+        b.links_to_disks = 1;
+        b.snapshot_path = snapshot ? snapshot_.c_str() : nullptr;
+        b.sysfs_block_dir = sys_.c_str();
+        b.sg_dev_dir = dev_.c_str();
+        return b;
+    }
+
+  private:
+    std::string path_;
+    std::string by_name_, emmc_, sys_, dev_, snapshot_;
+};
+
+}  // namespace gpt_test
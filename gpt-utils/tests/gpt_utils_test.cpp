@@ -0,0 +1,922 @@
+/*
+ * SPDX-FileCopyrightText: 2024 The LineageOS Project
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//Tests of gpt-utils on the image backend. gpt-utils.cpp is built into this
+//file, so that the tests reach its internals and stand between it and the
+//disks: the opens, reads and ioctls it issues are counted, and its writes
+//and flushes counted, logged and cut short on demand.
+
+//Everything gpt-utils.cpp includes comes first, so that the hooks below
+//only replace its own calls
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <scsi/ufs/ioctl.h>
+#include <scsi/ufs/ufs.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Write {
+    int64_t offset;
+    std::vector<uint8_t> data;
+};
+
+//State of the hooks, shared by the threads of a stage
+struct Hooks {
+    std::mutex lock;
+    //Writes after the first write_limit ones fail with EIO, unless negative
+    long write_limit = -1;
+    long writes = 0;
+    long flushes = 0;
+    //Successful opens of each file, and the reads and ioctls it got
+    std::map<std::string, int> opens;
+    std::map<std::string, int> reads;
+    std::map<std::string, int> ioctls;
+    //Writes of each file by flush epoch, if log is set
+    bool log = false;
+    std::map<std::string, std::vector<std::vector<Write>>> epochs;
+} hooks;
+
+std::string FdPath(int fd) {
+    char path[PATH_MAX];
+    ssize_t len = readlink(("/proc/self/fd/" + std::to_string(fd)).c_str(), path, sizeof(path));
+    return len > 0 ? std::string(path, len) : std::string();
+}
+
+ssize_t hooked_pwrite64(int fd, const void* buf, size_t len, off64_t offset) {
+    {
+        std::lock_guard<std::mutex> guard(hooks.lock);
+        if (hooks.write_limit >= 0 && hooks.writes >= hooks.write_limit) {
+            errno = EIO;
+            return -1;
+        }
+        hooks.writes++;
+        if (hooks.log) {
+            std::vector<std::vector<Write>>& epochs = hooks.epochs[FdPath(fd)];
+            if (epochs.empty()) epochs.emplace_back();
+            const uint8_t* data = static_cast<const uint8_t*>(buf);
+            epochs.back().push_back({offset, std::vector<uint8_t>(data, data + len)});
+        }
+    }
+    return pwrite64(fd, buf, len, offset);
+}
+
+int hooked_fdatasync(int fd) {
+    {
+        std::lock_guard<std::mutex> guard(hooks.lock);
+        hooks.flushes++;
+        if (hooks.log) {
+            std::vector<std::vector<Write>>& epochs = hooks.epochs[FdPath(fd)];
+            if (!epochs.empty() && !epochs.back().empty()) epochs.emplace_back();
+        }
+    }
+    return fdatasync(fd);
+}
+
+ssize_t hooked_pread64(int fd, void* buf, size_t len, off64_t offset) {
+    {
+        std::lock_guard<std::mutex> guard(hooks.lock);
+        hooks.reads[FdPath(fd)]++;
+    }
+    return pread64(fd, buf, len, offset);
+}
+
+ssize_t hooked_preadv64(int fd, const struct iovec* iov, int iovcnt, off64_t offset) {
+    {
+        std::lock_guard<std::mutex> guard(hooks.lock);
+        hooks.reads[FdPath(fd)]++;
+    }
+    return preadv64(fd, iov, iovcnt, offset);
+}
+
+int hooked_ioctl(int fd, unsigned long request, void* arg) {
+    {
+        std::lock_guard<std::mutex> guard(hooks.lock);
+        hooks.ioctls[FdPath(fd)]++;
+    }
+    return ioctl(fd, request, arg);
+}
+
+int hooked_open(const char* path, int flags, ...) {
+    mode_t mode = 0;
+    int fd;
+
+    if (flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    fd = open(path, flags, mode);
+    if (fd >= 0) {
+        std::lock_guard<std::mutex> guard(hooks.lock);
+        hooks.opens[FdPath(fd)]++;
+    }
+    return fd;
+}
+
+}  // namespace
+
+//Defined by gpt-utils.cpp itself
+#undef _LARGEFILE64_SOURCE
+#define pread64 hooked_pread64
+#define preadv64 hooked_preadv64
+#define pwrite64 hooked_pwrite64
+#define fdatasync hooked_fdatasync
+#define ioctl hooked_ioctl
+#define open hooked_open
+#include "../gpt-utils.cpp"
+#undef pread64
+#undef preadv64
+#undef pwrite64
+#undef fdatasync
+#undef ioctl
+#undef open
+
+#include "gpt_image.h"
+
+using gpt_test::ImageDir;
+using gpt_test::ReadFile;
+using gpt_test::WriteFile;
+
+namespace {
+
+const enum boot_update_stage kStages[] = {UPDATE_MAIN, UPDATE_BACKUP, UPDATE_FINALIZE};
+
+void ResetHooks() {
+    std::lock_guard<std::mutex> guard(hooks.lock);
+    hooks.write_limit = -1;
+    hooks.writes = 0;
+    hooks.flushes = 0;
+    hooks.opens.clear();
+    hooks.reads.clear();
+    hooks.ioctls.clear();
+    hooks.log = false;
+    hooks.epochs.clear();
+}
+
+//UTF-16 name field holding name
+std::vector<uint8_t> Name16(const char* name) {
+    std::vector<uint8_t> name16(MAX_GPT_NAME_SIZE);
+    for (size_t i = 0; name[i] && i < MAX_GPT_NAME_SIZE / 2; i++) name16[2 * i] = name[i];
+    return name16;
+}
+
+//State of the GPT whose header is at block lba of img: GPT_OK if both its
+//header and its entry array are intact
+enum gpt_state GptState(const std::vector<uint8_t>& img, uint32_t block_size, uint64_t lba) {
+    if ((lba + 1) * block_size > img.size()) return GPT_BAD_CRC;
+    const uint8_t* hdr = &img[lba * block_size];
+    if (memcmp(hdr, GPT_SIGNATURE, sizeof(GPT_SIGNATURE) - 1)) return GPT_BAD_SIGNATURE;
+
+    uint32_t hdr_size = GET_4_BYTES(hdr + HEADER_SIZE_OFFSET);
+    if (hdr_size < HEADER_CRC_OFFSET + 4 || hdr_size > block_size) return GPT_BAD_CRC;
+    std::vector<uint8_t> copy(hdr, hdr + hdr_size);
+    PUT_4_BYTES(&copy[HEADER_CRC_OFFSET], 0);
+    if (sparse_crc32(0, copy.data(), hdr_size) != GET_4_BYTES(hdr + HEADER_CRC_OFFSET))
+        return GPT_BAD_CRC;
+
+    uint64_t arr = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
+    uint64_t arr_size = (uint64_t)GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) *
+                        GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
+    if (arr + arr_size > img.size() ||
+        sparse_crc32(0, &img[arr], arr_size) != GET_4_BYTES(hdr + PARTITION_CRC_OFFSET))
+        return GPT_BAD_CRC;
+    return GPT_OK;
+}
+
+//Whether the bootloader finds a GPT to boot from on path: a valid primary
+//one, or a valid secondary one once the primary signature is cleared
+bool Bootable(const std::string& path, uint32_t block_size) {
+    std::vector<uint8_t> img = ReadFile(path);
+    enum gpt_state primary = GptState(img, block_size, 1);
+
+    return primary == GPT_OK ||
+           (primary == GPT_BAD_SIGNATURE &&
+            GptState(img, block_size, img.size() / block_size - 1) == GPT_OK);
+}
+
+//One disk holding boot critical partitions and their backups: the eMMC, or
+//a UFS LUN of a device booting without XBL
+class StageCrashTest : public ::testing::TestWithParam<bool> {
+  protected:
+    void SetUp() override {
+        bool ufs = GetParam();
+        disk_ = dir_.Disk(ufs ? "sde" : "mmcblk0");
+        block_size_ = ufs ? 4096 : 512;
+        ASSERT_TRUE(dir_.ok());
+        ASSERT_TRUE(dir_.AddDisk(ufs ? "sde" : "mmcblk0", block_size_,
+                                 {"tz", "tzbak", "abl", "ablbak", "hyp", "hypbak", "boot_a",
+                                  "boot_b"}));
+        backend_ = dir_.Backend(ufs, block_size_, ufs ? "" : "mmcblk0");
+        ASSERT_EQ(0, gpt_utils_set_backend(&backend_));
+        ResetHooks();
+    }
+    void TearDown() override {
+        ResetHooks();
+        gpt_utils_set_backend(nullptr);
+    }
+
+    ImageDir dir_;
+    gpt_utils_backend backend_;
+    std::string disk_;
+    uint32_t block_size_;
+};
+
+//Stops each stage after each of its writes: the disk must stay bootable
+TEST_P(StageCrashTest, StopAfterWrite) {
+    for (enum boot_update_stage stage : kStages) {
+        std::vector<uint8_t> before = ReadFile(disk_);
+        ResetHooks();
+        ASSERT_EQ(0, prepare_boot_update(stage)) << "stage " << stage;
+        long writes = hooks.writes;
+        std::vector<uint8_t> after = ReadFile(disk_);
+        ASSERT_GT(writes, 0) << "stage " << stage;
+        EXPECT_LE(hooks.flushes, 2) << "stage " << stage;
+        EXPECT_TRUE(Bootable(disk_, block_size_)) << "stage " << stage;
+
+        for (long n = 0; n < writes; n++) {
+            ASSERT_TRUE(WriteFile(disk_, before));
+            ResetHooks();
+            hooks.write_limit = n;
+            EXPECT_NE(0, prepare_boot_update(stage)) << "stage " << stage << " write " << n;
+            hooks.write_limit = -1;
+            EXPECT_TRUE(Bootable(disk_, block_size_)) << "stage " << stage << " write " << n;
+        }
+        ASSERT_TRUE(WriteFile(disk_, after));
+    }
+}
+
+//Writes between two flushes may reach the disk in any order, so any subset
+//of them may be lost in a crash
+TEST_P(StageCrashTest, LoseUnflushedWrites) {
+    std::string crash = dir_.Disk("crash");
+    std::string key = std::filesystem::canonical(disk_);
+
+    for (enum boot_update_stage stage : kStages) {
+        std::vector<uint8_t> durable = ReadFile(disk_);
+        ResetHooks();
+        hooks.log = true;
+        ASSERT_EQ(0, prepare_boot_update(stage)) << "stage " << stage;
+        hooks.log = false;
+        ASSERT_EQ(1u, hooks.epochs.size()) << "stage " << stage;
+
+        for (const std::vector<Write>& epoch : hooks.epochs[key]) {
+            ASSERT_LT(epoch.size(), 16u) << "stage " << stage;
+            for (uint32_t kept = 0; kept < (1u << epoch.size()); kept++) {
+                std::vector<uint8_t> img = durable;
+                for (size_t i = 0; i < epoch.size(); i++) {
+                    if (!(kept & (1u << i))) continue;
+                    std::copy(epoch[i].data.begin(), epoch[i].data.end(),
+                              img.begin() + epoch[i].offset);
+                }
+                ASSERT_TRUE(WriteFile(crash, img));
+                EXPECT_TRUE(Bootable(crash, block_size_))
+                        << "stage " << stage << " writes kept " << kept;
+            }
+            for (const Write& write : epoch)
+                std::copy(write.data.begin(), write.data.end(), durable.begin() + write.offset);
+        }
+        EXPECT_TRUE(durable == ReadFile(disk_)) << "stage " << stage;
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(GptUtils, StageCrashTest, ::testing::Values(false, true),
+                         [](const ::testing::TestParamInfo<bool>& info) {
+                             return info.param ? "Ufs" : "Emmc";
+                         });
+
+//Both slots of every A/B partition, on one eMMC or spread over two UFS LUNs
+class DiskOpenTest : public ::testing::TestWithParam<bool> {
+  protected:
+    void SetUp() override {
+        static const char* ab[] = {AB_PTN_LIST};
+        bool ufs = GetParam();
+        std::vector<std::string> partitions[2];
+
+        ASSERT_TRUE(dir_.ok());
+        disks_ = ufs ? std::vector<std::string>{"sde", "sdf"}
+                     : std::vector<std::string>{"mmcblk0"};
+        block_size_ = ufs ? 4096 : 512;
+        for (size_t i = 0; i < ARRAY_SIZE(ab); i++) {
+            std::vector<std::string>& lun = partitions[i * disks_.size() / ARRAY_SIZE(ab)];
+            lun.push_back(std::string(ab[i]) + AB_SLOT_A_SUFFIX);
+            lun.push_back(std::string(ab[i]) + AB_SLOT_B_SUFFIX);
+        }
+        for (size_t i = 0; i < disks_.size(); i++)
+            ASSERT_TRUE(dir_.AddDisk(disks_[i], block_size_, partitions[i]));
+        backend_ = dir_.Backend(ufs, block_size_, ufs ? "" : "mmcblk0");
+        ASSERT_EQ(0, gpt_utils_set_backend(&backend_));
+        ResetHooks();
+    }
+    void TearDown() override {
+        ResetHooks();
+        gpt_utils_set_backend(nullptr);
+    }
+
+    int Opens(const std::string& disk) {
+        return hooks.opens[std::filesystem::canonical(dir_.Disk(disk))];
+    }
+    int Reads(const std::string& disk) {
+        return hooks.reads[std::filesystem::canonical(dir_.Disk(disk))];
+    }
+    int Ioctls(const std::string& disk) {
+        return hooks.ioctls[std::filesystem::canonical(dir_.Disk(disk))];
+    }
+    //Whether the headers and entry arrays of both GPTs of every disk match
+    //their CRCs, as the commits patch those rather than recompute them
+    void ExpectGptsValid(const std::string& when) {
+        for (const std::string& disk : disks_) {
+            std::vector<uint8_t> img = ReadFile(dir_.Disk(disk));
+            EXPECT_EQ(GPT_OK, GptState(img, block_size_, 1)) << disk << " primary " << when;
+            EXPECT_EQ(GPT_OK, GptState(img, block_size_, img.size() / block_size_ - 1))
+                    << disk << " secondary " << when;
+        }
+    }
+
+    ImageDir dir_;
+    gpt_utils_backend backend_;
+    std::vector<std::string> disks_;
+    uint32_t block_size_;
+};
+
+//A loaded handle keeps its disk open for all the calls it serves. A load
+//reads each GPT with one call, and a commit of one changed entry only
+//writes: both headers, the entry's sector in both arrays, and a flush
+//after each GPT. Block sizes come from the backend, never from ioctls.
+TEST_P(DiskOpenTest, OpenOncePerHandle) {
+    struct gpt_disk* disk = gpt_disk_alloc();
+    const std::string& lun = disks_.back();
+    uint8_t attr = AB_PARTITION_ATTR_SLOT_ACTIVE;
+
+    ASSERT_NE(nullptr, disk);
+    ASSERT_EQ(0, gpt_disk_get_disk_info("boot_a", disk));
+    EXPECT_EQ(1, Opens(lun));
+    EXPECT_EQ(2, Reads(lun));
+    EXPECT_EQ(0, Ioctls(lun));
+    for (int i = 1; i <= 2; i++) {
+        for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+            const uint8_t* pentry = gpt_disk_find_pentry(disk, "boot_a", instance);
+            ASSERT_NE(nullptr, pentry);
+            ASSERT_EQ(0, gpt_disk_update_pentry(disk, instance, pentry, AB_FLAG_OFFSET, &attr, 1));
+        }
+        ASSERT_EQ(0, gpt_disk_update_crc(disk));
+        ASSERT_EQ(0, gpt_disk_commit(disk));
+        EXPECT_EQ(1, Opens(lun)) << "commit " << i;
+        EXPECT_EQ(2, Reads(lun)) << "commit " << i;
+        EXPECT_EQ(0, Ioctls(lun)) << "commit " << i;
+        EXPECT_EQ(4 * i, hooks.writes) << "commit " << i;
+        EXPECT_EQ(2 * i, hooks.flushes) << "commit " << i;
+        ExpectGptsValid("after commit " + std::to_string(i));
+        attr = 0;
+    }
+    gpt_disk_free(disk);
+    EXPECT_EQ(1, Opens(lun));
+}
+
+//Same with a snapshot: the first load after each commit reads the disk
+//and publishes its tables, the next ones copy them from the snapshot
+//without reading it. Commits from those tables write the same.
+TEST_P(DiskOpenTest, OpenOncePerHandleWithSnapshot) {
+    const std::string& lun = disks_.back();
+    uint8_t attr = 0;
+
+    backend_ = dir_.Backend(GetParam(), block_size_, GetParam() ? "" : "mmcblk0", "snapshot");
+    ASSERT_EQ(0, gpt_utils_set_backend(&backend_));
+    for (int round = 0; round < 2; round++) {
+        for (int load = 0; load < 2; load++) {
+            std::string when = "round " + std::to_string(round) + " load " + std::to_string(load);
+            struct gpt_disk* disk = gpt_disk_alloc();
+            ASSERT_NE(nullptr, disk);
+            ResetHooks();
+            ASSERT_EQ(0, gpt_disk_get_disk_info("boot_a", disk)) << when;
+            EXPECT_EQ(1, Opens(lun)) << when;
+            EXPECT_EQ(load ? 0 : 2, Reads(lun)) << when;
+            EXPECT_EQ(0, Ioctls(lun)) << when;
+            for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+                const uint8_t* pentry = gpt_disk_find_pentry(disk, "boot_a", instance);
+                ASSERT_NE(nullptr, pentry) << when;
+                EXPECT_EQ(attr, pentry[AB_FLAG_OFFSET]) << when;
+            }
+            if (load) {
+                attr ^= AB_PARTITION_ATTR_SLOT_ACTIVE;
+                for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+                    const uint8_t* pentry = gpt_disk_find_pentry(disk, "boot_a", instance);
+                    ASSERT_EQ(0, gpt_disk_update_pentry(disk, instance, pentry, AB_FLAG_OFFSET,
+                                                        &attr, 1));
+                }
+                ASSERT_EQ(0, gpt_disk_update_crc(disk));
+                ASSERT_EQ(0, gpt_disk_commit(disk));
+                EXPECT_EQ(1, Opens(lun)) << when;
+                EXPECT_EQ(0, Reads(lun)) << when;
+                EXPECT_EQ(4, hooks.writes) << when;
+                EXPECT_EQ(2, hooks.flushes) << when;
+                ExpectGptsValid("after commit, " + when);
+            }
+            gpt_disk_free(disk);
+        }
+    }
+}
+
+//Each disk holding slot partitions is loaded and committed once
+TEST_P(DiskOpenTest, OpenOncePerDiskForSlotAttributes) {
+    ASSERT_EQ(0, gpt_utils_set_slot_attributes(1, AB_PARTITION_ATTR_SLOT_ACTIVE));
+    for (const std::string& disk : disks_) EXPECT_EQ(1, Opens(disk)) << disk;
+    ExpectGptsValid("after commit");
+
+    std::optional<gpt::Disk> disk = gpt::Disk::Load("boot_b");
+    ASSERT_TRUE(disk);
+    std::optional<gpt::Entry> entry = disk->Find(SECONDARY_GPT, "boot_b");
+    ASSERT_TRUE(entry);
+    EXPECT_TRUE(entry->Raw()[AB_FLAG_OFFSET] & AB_PARTITION_ATTR_SLOT_ACTIVE);
+}
+
+INSTANTIATE_TEST_SUITE_P(GptUtils, DiskOpenTest, ::testing::Values(false, true),
+                         [](const ::testing::TestParamInfo<bool>& info) {
+                             return info.param ? "Ufs" : "Emmc";
+                         });
+
+//Same disks, checked for the attribute bytes written
+using SlotAttributesTest = DiskOpenTest;
+
+//A/B attribute byte of partition in both GPT instances
+std::vector<uint8_t> SlotAttributes(const char* partition) {
+    std::vector<uint8_t> attrs;
+    std::optional<gpt::Disk> disk = gpt::Disk::Load(partition);
+
+    for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+        std::optional<gpt::Entry> entry;
+        if (disk) entry = disk->Find(instance, partition);
+        if (entry) attrs.push_back(entry->Raw()[AB_FLAG_OFFSET]);
+    }
+    return attrs;
+}
+
+//Activating a slot whose retries ran out makes it bootable again
+TEST_P(SlotAttributesTest, ActivateResetsRetryCount) {
+    const uint8_t exhausted = AB_PARTITION_ATTR_UNBOOTABLE;
+    const uint8_t successful = AB_SLOT_ACTIVE_VAL | AB_PARTITION_ATTR_BOOT_SUCCESSFUL;
+
+    for (const auto& [partition, attr] :
+         {std::pair("boot_a", &successful), std::pair("boot_b", &exhausted)}) {
+        std::optional<gpt::Disk> disk = gpt::Disk::Load(partition);
+        ASSERT_TRUE(disk);
+        for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+            std::optional<gpt::Entry> entry = disk->Find(instance, partition);
+            ASSERT_TRUE(entry);
+            ASSERT_EQ(0, disk->Update(*entry, AB_FLAG_OFFSET, {attr, 1}));
+        }
+        ASSERT_EQ(0, disk->Commit());
+        ExpectGptsValid(std::string("after commit of ") + partition);
+    }
+
+    ASSERT_EQ(0, gpt_utils_set_slot_attributes(1, AB_PARTITION_ATTR_SLOT_ACTIVE));
+    ExpectGptsValid("after activating slot b");
+    EXPECT_EQ(std::vector<uint8_t>(2, AB_SLOT_ACTIVE_VAL), SlotAttributes("boot_b"));
+    EXPECT_EQ(std::vector<uint8_t>(2, successful & ~AB_PARTITION_ATTR_SLOT_ACTIVE),
+              SlotAttributes("boot_a"));
+
+    //Other bits are only ever set, the slot stays active
+    ASSERT_EQ(0, gpt_utils_set_slot_attributes(1, AB_PARTITION_ATTR_BOOT_SUCCESSFUL));
+    ExpectGptsValid("after marking slot b successful");
+    EXPECT_EQ(std::vector<uint8_t>(2, successful), SlotAttributes("boot_b"));
+}
+
+INSTANTIATE_TEST_SUITE_P(GptUtils, SlotAttributesTest, ::testing::Values(false, true),
+                         [](const ::testing::TestParamInfo<bool>& info) {
+                             return info.param ? "Ufs" : "Emmc";
+                         });
+
+//UFS device booting from XBL, its boot critical partitions spread over
+//three LUNs, with a partition table snapshot
+class UfsBootTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        ASSERT_TRUE(dir_.ok());
+        ASSERT_TRUE(dir_.AddDisk("sda", 4096, {"xbl", "xbl_config"}));
+        ASSERT_TRUE(dir_.AddDisk("sdb", 4096, {"xblbak", "xbl_configbak"}));
+        ASSERT_TRUE(dir_.AddDisk("sde", 4096, {"tz", "tzbak", "abl", "ablbak"}));
+        ASSERT_TRUE(dir_.AddSgNode("sda", "sg0"));
+        ASSERT_TRUE(dir_.AddSgNode("sdb", "sg1"));
+        ASSERT_TRUE(dir_.AddSgNode("sde", "sg4"));
+        backend_ = dir_.Backend(true, 4096, "", "snapshot");
+        ASSERT_EQ(0, gpt_utils_set_backend(&backend_));
+        ResetHooks();
+    }
+    void TearDown() override {
+        ResetHooks();
+        gpt_utils_set_backend(nullptr);
+    }
+
+    uint8_t BootLun(const char* sg) { return ReadFile(dir_.SgNode(sg)).at(0); }
+    //Logged writes to the scsi generic node sg
+    size_t SgWrites(const char* sg) {
+        size_t writes = 0;
+        for (const std::vector<Write>& epoch :
+             hooks.epochs[std::filesystem::canonical(dir_.SgNode(sg))])
+            writes += epoch.size();
+        return writes;
+    }
+    ImageDir dir_;
+    gpt_utils_backend backend_;
+};
+
+//Tables are taken from the snapshot until the library writes the disk,
+//then read again and republished
+TEST_F(UfsBootTest, SnapshotFollowsCommits) {
+    const std::string lun = std::filesystem::canonical(dir_.Disk("sde"));
+    std::vector<uint8_t> name = Name16("hyp");
+
+    for (int i = 0; i < 2; i++) {
+        ResetHooks();
+        std::optional<gpt::Disk> disk = gpt::Disk::Load("tz");
+        ASSERT_TRUE(disk);
+        EXPECT_EQ(i ? 0 : 2, hooks.reads[lun]) << "load " << i;
+        std::optional<gpt::Entry> entry = disk->Find(PRIMARY_GPT, "abl");
+        ASSERT_TRUE(entry);
+        EXPECT_EQ("abl", entry->Name());
+        EXPECT_FALSE(disk->Find(PRIMARY_GPT, "hyp"));
+    }
+    std::optional<gpt::Disk> disk = gpt::Disk::Load("tz");
+    ASSERT_TRUE(disk);
+    for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+        std::optional<gpt::Entry> entry = disk->Find(instance, "abl");
+        ASSERT_TRUE(entry);
+        ASSERT_EQ(0, disk->Update(*entry, PARTITION_NAME_OFFSET, name));
+    }
+    ASSERT_EQ(0, disk->Commit());
+    disk.reset();
+    for (int i = 0; i < 2; i++) {
+        ResetHooks();
+        disk = gpt::Disk::Load("tz");
+        ASSERT_TRUE(disk);
+        EXPECT_EQ(i ? 0 : 2, hooks.reads[lun]) << "load " << i << " after commit";
+        //Only its backup twin is left
+        std::optional<gpt::Entry> entry = disk->Find(PRIMARY_GPT, "abl");
+        ASSERT_TRUE(entry);
+        EXPECT_EQ("ablbak", entry->Name());
+        EXPECT_TRUE(disk->Find(SECONDARY_GPT, "hyp"));
+    }
+}
+
+//The topology cache of a forked child must follow the by-name directory,
+//and the parent's must keep following it
+TEST_F(UfsBootTest, ForkedChildSeesNewLinks) {
+    ASSERT_TRUE(gpt::Disk::Load("tz"));
+    EXPECT_FALSE(gpt::Disk::Load("hyp"));
+    GTEST_FLAG_SET(death_test_style, "fast");
+    EXPECT_EXIT(
+            {
+                alarm(10);
+                if (!dir_.AddDisk("sdf", 4096, {"hyp", "hypbak"})) _exit(2);
+                _exit(gpt::Disk::Load("hyp") ? 0 : 1);
+            },
+            ::testing::ExitedWithCode(0), "");
+    EXPECT_TRUE(gpt::Disk::Load("hyp"));
+}
+
+//Count of op in gpt_utils_dump_stats(), -1 if missing
+long StatCount(const char* op) {
+    char name[16];
+    long count;
+    FILE* f = tmpfile();
+
+    if (!f) return -1;
+    gpt_utils_dump_stats(fileno(f));
+    rewind(f);
+    fscanf(f, "%*[^\n]\n");
+    while (fscanf(f, "%15s %ld%*[^\n]\n", name, &count) == 2) {
+        if (!strcmp(name, op)) {
+            fclose(f);
+            return count;
+        }
+    }
+    fclose(f);
+    return -1;
+}
+
+//Publishing a snapshot writes and checksums a file, not a GPT
+TEST_F(UfsBootTest, SnapshotNotCounted) {
+    long writes = StatCount("write");
+    ASSERT_GE(writes, 0);
+    ASSERT_TRUE(gpt::Disk::Load("tz"));
+    EXPECT_TRUE(std::filesystem::exists(dir_.path() + "/snapshot"));
+    EXPECT_EQ(writes, StatCount("write"));
+}
+
+//Preparing a LUN holds the snapshot lock while it looks the XBL links up,
+//which used to take the lock again to publish the disk map
+TEST_F(UfsBootTest, AllStagesWithSnapshot) {
+    GTEST_FLAG_SET(death_test_style, "threadsafe");
+    EXPECT_EXIT(
+            {
+                alarm(10);
+                for (enum boot_update_stage stage : kStages)
+                    if (prepare_boot_update(stage)) _exit(stage);
+                _exit(BootLun("sg0") == BOOT_LUN_A_ID ? 0 : 10);
+            },
+            ::testing::ExitedWithCode(0), "");
+}
+
+TEST_F(UfsBootTest, SwitchBootLun) {
+    hooks.log = true;
+    ASSERT_EQ(0, gpt_utils_set_xbl_boot_partition(BACKUP_BOOT));
+    EXPECT_EQ(BOOT_LUN_B_ID, BootLun("sg1"));
+    EXPECT_EQ(1u, SgWrites("sg1"));
+    ASSERT_EQ(0, gpt_utils_set_xbl_boot_partition(NORMAL_BOOT));
+    EXPECT_EQ(BOOT_LUN_A_ID, BootLun("sg0"));
+    EXPECT_EQ(1u, SgWrites("sg0"));
+}
+
+//Stage transitions ask for the boot LUN in use more often than not
+TEST_F(UfsBootTest, KeepCurrentBootLun) {
+    ASSERT_EQ(0, gpt_utils_set_xbl_boot_partition(NORMAL_BOOT));
+    ResetHooks();
+    hooks.log = true;
+    ASSERT_EQ(0, gpt_utils_set_xbl_boot_partition(NORMAL_BOOT));
+    EXPECT_EQ(BOOT_LUN_A_ID, BootLun("sg0"));
+    EXPECT_EQ(0u, SgWrites("sg0"));
+}
+
+//A backup header claiming more entries than the primary one must not
+//widen the backup array writes past the entries actually tracked. The
+//read past the dirty bitmap this used to do shows in sanitized builds.
+TEST(GptCommitTest, BackupHeaderWithMoreEntries) {
+    ImageDir dir;
+    ASSERT_TRUE(dir.AddDisk("mmcblk0", 512, {"boot_a", "boot_b"}));
+    std::string path = dir.Disk("mmcblk0");
+    std::vector<uint8_t> img = ReadFile(path);
+    uint8_t* hdr_bak = &img[img.size() - 512];
+    //Twice the entries, read from where they fit on the disk
+    gpt_test::Put32(hdr_bak + PARTITION_COUNT_OFFSET, 2 * 128);
+    gpt_test::Put64(hdr_bak + PENTRIES_OFFSET, 2);
+    gpt_test::Put32(hdr_bak + HEADER_CRC_OFFSET, 0);
+    gpt_test::Put32(hdr_bak + HEADER_CRC_OFFSET, sparse_crc32(0, hdr_bak, 92));
+    ASSERT_TRUE(WriteFile(path, img));
+    gpt_utils_backend backend = dir.Backend(false, 512, "mmcblk0");
+    ASSERT_EQ(0, gpt_utils_set_backend(&backend));
+
+    std::optional<gpt::Disk> disk = gpt::Disk::Load("boot_a");
+    ASSERT_TRUE(disk);
+    for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+        std::optional<gpt::Entry> entry = disk->Find(instance, "boot_a");
+        uint8_t attr = AB_PARTITION_ATTR_SLOT_ACTIVE;
+        ASSERT_TRUE(entry);
+        ASSERT_EQ(0, disk->Update(*entry, AB_FLAG_OFFSET, {&attr, 1}));
+    }
+    ResetHooks();
+    hooks.log = true;
+    ASSERT_EQ(0, disk->Commit());
+    hooks.log = false;
+    size_t written = 0;
+    for (const std::vector<Write>& epoch : hooks.epochs[std::filesystem::canonical(path)])
+        for (const Write& write : epoch) written += write.data.size();
+    //Both headers and one sector of each array
+    EXPECT_EQ(4u * 512, written);
+    EXPECT_EQ(img.size(), ReadFile(path).size());
+    disk.reset();
+    ResetHooks();
+    gpt_utils_set_backend(nullptr);
+}
+
+//Names sharing prefixes with each other, as the XBL ones do, and names
+//filling the whole field
+const char* const kNearMissNames[] = {
+        "xbl",     "xbl_config", "xblbak", "xbl_configbak", "xbl_a", "xbl_b", "xb", "",
+        "abcdefghijklmnopqrstuvwxyz01234",   "abcdefghijklmnopqrstuvwxyz012345",
+        "abcdefghijklmnopqrstuvwxyz0123456", "abcdefghijklmnopqrstuvwxyz0123456789",
+};
+
+//Narrowing must match the scalar loop byte for byte, the high bytes of
+//non-ASCII code units included
+TEST(GptNameTest, NarrowNearMissNames) {
+    for (const char* name : kNearMissNames) {
+        for (uint8_t high : {0x00, 0x04}) {
+            uint8_t name16[MAX_GPT_NAME_SIZE] = {};
+            char name8[MAX_GPT_NAME8_SIZE];
+            char expected[MAX_GPT_NAME8_SIZE];
+
+            for (size_t i = 0; name[i] && i < MAX_GPT_NAME_SIZE / 2; i++) {
+                name16[2 * i] = name[i];
+                name16[2 * i + 1] = i % 3 ? 0 : high;
+            }
+            for (size_t i = 0; i < MAX_GPT_NAME8_SIZE - 1; i++) expected[i] = name16[2 * i];
+            expected[MAX_GPT_NAME8_SIZE - 1] = '\0';
+            EXPECT_EQ(strlen(expected), gpt_name_narrow(name16, name8)) << name;
+            EXPECT_STREQ(expected, name8) << name;
+        }
+    }
+}
+
+//Lookups return the first entry named name or its name-bak twin, and
+//nothing else sharing a prefix with it
+TEST(GptNameTest, FindNearMissNames) {
+    ImageDir dir;
+    ASSERT_TRUE(dir.AddDisk("mmcblk0", 512, {"xbl_configbak", "xblbak", "xbl_config", "xbl"}));
+    gpt_utils_backend backend = dir.Backend(false, 512, "mmcblk0");
+    ASSERT_EQ(0, gpt_utils_set_backend(&backend));
+
+    std::optional<gpt::Disk> disk = gpt::Disk::Load("xbl");
+    ASSERT_TRUE(disk);
+    const std::pair<const char*, const char*> found[] = {
+            {"xbl", "xblbak"},
+            {"xbl_config", "xbl_configbak"},
+            {"xblbak", "xblbak"},
+            {"xbl_configbak", "xbl_configbak"},
+    };
+    for (const auto& [name, expected] : found) {
+        for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+            std::optional<gpt::Entry> entry = disk->Find(instance, name);
+            ASSERT_TRUE(entry) << name;
+            EXPECT_EQ(std::string_view(expected), entry->Name()) << name;
+        }
+    }
+    for (const char* name : {"xb", "xbl_", "xblb", "xbl_configba", "xbl_configbakk"})
+        EXPECT_FALSE(disk->Find(PRIMARY_GPT, name)) << name;
+    disk.reset();
+    gpt_utils_set_backend(nullptr);
+}
+
+//A renamed entry is found under its new name only, in either way of
+//writing it, and shows its new name in the view
+TEST(GptNameTest, RenameEntry) {
+    ImageDir dir;
+    ASSERT_TRUE(dir.AddDisk("mmcblk0", 512, {"xbl", "abl", "hyp", "tz"}));
+    gpt_utils_backend backend = dir.Backend(false, 512, "mmcblk0");
+    ASSERT_EQ(0, gpt_utils_set_backend(&backend));
+    struct gpt_disk* disk = gpt_disk_alloc();
+    ASSERT_NE(nullptr, disk);
+    ASSERT_EQ(0, gpt_disk_get_disk_info("abl", disk));
+
+    for (enum gpt_instance instance : {PRIMARY_GPT, SECONDARY_GPT}) {
+        const uint8_t* abl = gpt_disk_find_pentry(disk, "abl", instance);
+        const uint8_t* hyp = gpt_disk_find_pentry(disk, "hyp", instance);
+        const uint8_t* tz = gpt_disk_find_pentry(disk, "tz", instance);
+        ASSERT_TRUE(abl && hyp && tz);
+        const uint8_t* arr = instance == PRIMARY_GPT ? disk->pentry_arr : disk->pentry_arr_bak;
+        const struct gpt_pentry_view* view = gpt_disk_get_view(disk, instance);
+
+        std::vector<uint8_t> name = Name16("abl_new");
+        ASSERT_EQ(0, gpt_disk_update_pentry(disk, instance, abl, PARTITION_NAME_OFFSET,
+                                            name.data(), name.size()));
+        EXPECT_EQ(abl, gpt_disk_find_pentry(disk, "abl_new", instance));
+        EXPECT_EQ(nullptr, gpt_disk_find_pentry(disk, "abl", instance));
+        EXPECT_STREQ("abl_new", view->name[(abl - arr) / disk->pentry_size]);
+
+        //Written through the pointer, seen after the CRC update; the first
+        //of two entries with the same name wins
+        uint8_t* pentry = gpt_disk_get_pentry(disk, "hyp", instance);
+        ASSERT_EQ(hyp, pentry);
+        name = Name16("tz");
+        std::copy(name.begin(), name.end(), pentry + PARTITION_NAME_OFFSET);
+        ASSERT_EQ(0, gpt_disk_update_crc(disk));
+        EXPECT_EQ(hyp, gpt_disk_find_pentry(disk, "tz", instance));
+        EXPECT_EQ(nullptr, gpt_disk_find_pentry(disk, "hyp", instance));
+        EXPECT_STREQ("tz", view->name[(hyp - arr) / disk->pentry_size]);
+
+        //Renaming back leaves the other entry of that name alone
+        name = Name16("hyp");
+        ASSERT_EQ(0, gpt_disk_update_pentry(disk, instance, hyp, PARTITION_NAME_OFFSET,
+                                            name.data(), 6));
+        EXPECT_EQ(hyp, gpt_disk_find_pentry(disk, "hyp", instance));
+        EXPECT_EQ(tz, gpt_disk_find_pentry(disk, "tz", instance));
+        EXPECT_EQ(nullptr, gpt_disk_find_pentry(disk, "hz", instance));
+    }
+    //Renames are committed like any other change
+    ASSERT_EQ(0, gpt_disk_update_crc(disk));
+    ASSERT_EQ(0, gpt_disk_commit(disk));
+    gpt_disk_free(disk);
+    std::optional<gpt::Disk> reloaded = gpt::Disk::Load("abl_new");
+    ASSERT_TRUE(reloaded);
+    EXPECT_FALSE(reloaded->Find(PRIMARY_GPT, "abl"));
+    EXPECT_TRUE(reloaded->Find(SECONDARY_GPT, "hyp"));
+    reloaded.reset();
+    gpt_utils_set_backend(nullptr);
+}
+
+//The index must keep finding exactly the entries of each name, in order,
+//across renames that empty chains and free slots in the middle of probe
+//runs
+TEST(GptNameTest, RenameKeepsIndexConsistent) {
+    ImageDir dir;
+    ASSERT_TRUE(dir.AddDisk("mmcblk0", 512, {"p0", "p1", "p2", "p3"}));
+    gpt_utils_backend backend = dir.Backend(false, 512, "mmcblk0");
+    ASSERT_EQ(0, gpt_utils_set_backend(&backend));
+    struct gpt_disk* disk = gpt_disk_alloc();
+    ASSERT_NE(nullptr, disk);
+    ASSERT_EQ(0, gpt_disk_get_disk_info("p0", disk));
+    //Enough names for some to share probe runs in the 256 slot table
+    std::vector<std::string> names = {""};
+    uint32_t num = disk->view.num;
+    uint32_t seed = 1;
+
+    for (int i = 0; i < 64; i++) names.push_back("p" + std::to_string(i));
+    for (int round = 0; round < 2000; round++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t idx = (seed >> 8) % num;
+        std::vector<uint8_t> name16 = Name16(names[(seed >> 16) % names.size()].c_str());
+        ASSERT_EQ(0, gpt_disk_update_pentry(disk, PRIMARY_GPT,
+                                            disk->pentry_arr + idx * disk->pentry_size,
+                                            PARTITION_NAME_OFFSET, name16.data(),
+                                            name16.size()));
+        for (const std::string& name : names) {
+            const char* n = name.c_str();
+            int64_t after = -1;
+            for (uint32_t i = 0; i < num; i++) {
+                if (strcmp(disk->view.name[i], n)) continue;
+                ASSERT_EQ(i, gpt_pentry_index_find(&disk->index, n, after))
+                        << "round " << round << " name " << n;
+                after = i;
+            }
+            ASSERT_EQ(UINT32_MAX, gpt_pentry_index_find(&disk->index, n, after))
+                    << "round " << round << " name " << n;
+        }
+    }
+    gpt_disk_free(disk);
+    gpt_utils_set_backend(nullptr);
+}
+
+//Chunks must give the CRC of the image they expand to, whatever the
+//alignment of the fill runs
+TEST(SparseCrc32Test, ChunksMatchExpandedImage) {
+    const uint8_t raw[] = {0x3a, 0x00, 0xff, 0x5c, 0x81, 0x17, 0xe2};
+    const struct sparse_crc32_chunk chunks[] = {
+            {SPARSE_CRC32_CHUNK_RAW, 0, raw, sizeof(raw)},
+            {SPARSE_CRC32_CHUNK_FILL, 0xdeadbeef, nullptr, 4096 + 3},
+            {SPARSE_CRC32_CHUNK_DONT_CARE, 0, nullptr, 8192},
+            {SPARSE_CRC32_CHUNK_FILL, 0, nullptr, 17},
+            {SPARSE_CRC32_CHUNK_RAW, 0, raw, 5},
+            {SPARSE_CRC32_CHUNK_FILL, 0x01020304, nullptr, 1},
+    };
+    std::vector<uint8_t> image;
+
+    for (const struct sparse_crc32_chunk& chunk : chunks) {
+        for (uint64_t i = 0; i < chunk.len; i++) {
+            if (chunk.type == SPARSE_CRC32_CHUNK_RAW)
+                image.push_back(static_cast<const uint8_t*>(chunk.data)[i]);
+            else
+                image.push_back(reinterpret_cast<const uint8_t*>(&chunk.fill)[i % 4]);
+        }
+    }
+    EXPECT_EQ(sparse_crc32(0, image.data(), image.size()),
+              sparse_crc32_chunks(0, chunks, ARRAY_SIZE(chunks)));
+    //Chained calls continue the same CRC
+    uint32_t crc = sparse_crc32_chunks(0, chunks, 2);
+    EXPECT_EQ(sparse_crc32(0, image.data(), image.size()),
+              sparse_crc32_chunks(crc, chunks + 2, ARRAY_SIZE(chunks) - 2));
+}
+
+//The portable kernel must agree with the one picked for the CPU, over
+//lengths and alignments that hit its head, 8 byte loop and tail
+TEST(SparseCrc32Test, PortableKernelMatchesDispatched) {
+    std::vector<uint8_t> buf(4096 + 16);
+    const char check[] = "123456789";
+
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = i * 2654435761u >> 24;
+    sparse_crc32_force_portable(1);
+    EXPECT_EQ(0xcbf43926u, sparse_crc32(0, check, sizeof(check) - 1));
+    sparse_crc32_force_portable(0);
+    EXPECT_EQ(0xcbf43926u, sparse_crc32(0, check, sizeof(check) - 1));
+    for (size_t offset : {0, 1, 3, 7}) {
+        for (size_t len : {0, 1, 7, 8, 15, 63, 64, 65, 92, 511, 4096}) {
+            sparse_crc32_force_portable(1);
+            uint32_t portable = sparse_crc32(0x12345678, &buf[offset], len);
+            sparse_crc32_force_portable(0);
+            EXPECT_EQ(sparse_crc32(0x12345678, &buf[offset], len), portable)
+                    << "offset " << offset << " len " << len;
+        }
+    }
+}
+
+}  // namespace
@@ -0,0 +1,21 @@
+/*
+ * SPDX-FileCopyrightText: 2024 The LineageOS Project
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+//The part of the msm kernel's UFS ioctl UAPI that gpt-utils uses, for
+//builds without generated_kernel_headers (eg: host tests). Those only
+//reach stub scsi generic nodes, which are regular files.
+
+#pragma once
+
+#include <stdint.h>
+
+#define UFS_IOCTL_QUERY 0x5388
+
+struct ufs_ioctl_query_data {
+    uint32_t opcode;
+    uint8_t idn;
+    uint16_t buf_size;
+    uint8_t buffer[];
+};